@@ -2,10 +2,34 @@
 
 layout(binding = 0)  uniform sampler2D sampler;
 
+// Exposure in stops, tonemap matches the Tonemap enum in Frame
+layout(location = 0) uniform float exposure;
+layout(location = 1) uniform int tonemap;
+
 layout(location = 0) in  vec2 frag_uv;
 
 layout(location = 0) out vec4 diffuse;
 
+vec3 srgb_encode(vec3 linear) {
+    linear = max(linear, vec3(0.0));
+    vec3 low  = 12.92 * linear;
+    vec3 high = 1.055 * pow(linear, vec3(1.0 / 2.4)) - 0.055;
+    return mix(low, high, step(vec3(0.0031308), linear));
+}
+
+// Narkowicz 2015 fit of the ACES filmic curve
+vec3 aces(vec3 x) {
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
 void main() {
-    diffuse = texture(sampler, frag_uv);
+    vec3 color = texture(sampler, frag_uv).rgb * exp2(exposure);
+
+    if(tonemap == 1) {
+        color = srgb_encode(color / (1.0 + color));
+    }
+    else if(tonemap == 2) {
+        color = srgb_encode(aces(color));
+    }
+    diffuse = vec4(color, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+#include "../core.hpp"
+
+#include <chrono>
+
+struct BenchResult {
+    std::string name;
+    Float rate;
+    std::string unit;
+    /// Plain values, such as sizes, are printed as they are rather than in M/s
+    bool per_second = true;
+};
+
+/// Calls `fn` until `min_seconds` have passed, `fn` processes `items` per call
+/// Returns items per second
+template<typename Fn>
+Float measure_rate(size_t items, Fn fn, Float min_seconds = 0.25) {
+    using Clock = std::chrono::steady_clock;
+
+    // Warm up caches and branch predictors
+    fn();
+
+    size_t calls = 0;
+    auto start = Clock::now();
+    Float elapsed = 0.0;
+    while(elapsed < min_seconds) {
+        fn();
+        calls++;
+        elapsed = std::chrono::duration<Float>(Clock::now() - start).count();
+    }
+    return Float(calls * items) / elapsed;
+}
+
+/// Keeps the compiler from discarding a computed value
+template<typename T>
+void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+void bench_random(std::vector<BenchResult>& out);
+void bench_frame(std::vector<BenchResult>& out);
+void bench_shapes(std::vector<BenchResult>& out);
+void bench_pathtrace(std::vector<BenchResult>& out);
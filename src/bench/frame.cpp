@@ -0,0 +1,191 @@
+#include "core.hpp"
+
+#include <thread>
+
+namespace {
+    /// Frame accumulation as it was before RGBW: a f64 weight grid and a f64 color grid
+    struct LegacyAccumulator {
+        Grid2D<Float> weight;
+        Grid2D<Color> sum;
+
+        LegacyAccumulator(ivec2 size)
+        : weight(size, 0.0)
+        , sum(size, Colors::BLACK)
+        {}
+
+        static constexpr size_t PIXEL_BYTES = sizeof(Float) + sizeof(Color);
+
+        void add_bilinear(Vec2f uv, Color value) {
+            splat_bilinear(uv, weight.size, [&](i32 i, i32 j, Float w) {
+                if(0 <= i && i < weight.size.x && 0 <= j && j < weight.size.y) {
+                    weight.get(i, j) += w;
+                    sum.get(i, j) += w * value;
+                }
+            });
+        }
+
+        template<typename Fn>
+        void touched(Vec2f uv, Fn fn) {
+            splat_bilinear(uv, weight.size, [&](i32 i, i32 j, Float w) {
+                if(0 <= i && i < weight.size.x && 0 <= j && j < weight.size.y) {
+                    fn(&weight.get(i, j), sizeof(Float));
+                    fn(&sum.get(i, j), sizeof(Color));
+                }
+            });
+        }
+    };
+
+    /// Frame accumulation now, f32 RGBW in one 16 byte slot
+    struct CompactAccumulator {
+        Grid2D<RGBW> sum;
+
+        CompactAccumulator(ivec2 size)
+        : sum(size, { 0.0, 0.0, 0.0, 0.0 })
+        {}
+
+        static constexpr size_t PIXEL_BYTES = sizeof(RGBW);
+
+        void add_bilinear(Vec2f uv, Color value) {
+            splat_bilinear(uv, sum.size, [&](i32 i, i32 j, Float w) {
+                if(0 <= i && i < sum.size.x && 0 <= j && j < sum.size.y) {
+                    RGBW& pixel = sum.get(i, j);
+                    pixel.r += w * value.r;
+                    pixel.g += w * value.g;
+                    pixel.b += w * value.b;
+                    pixel.w += w;
+                }
+            });
+        }
+
+        template<typename Fn>
+        void touched(Vec2f uv, Fn fn) {
+            splat_bilinear(uv, sum.size, [&](i32 i, i32 j, Float w) {
+                if(0 <= i && i < sum.size.x && 0 <= j && j < sum.size.y) {
+                    fn(&sum.get(i, j), sizeof(RGBW));
+                }
+            });
+        }
+    };
+
+    /// 4K, far larger than the caches either way
+    const ivec2 SIZE = { 3840, 2160 };
+    constexpr size_t COUNT = 1 << 16;
+    constexpr size_t LINE = 64;
+
+    /// Distinct cache lines written per splat, each one a miss for scattered splats
+    template<typename Accumulator>
+    Float lines_per_sample(Accumulator& accumulator, const std::vector<Vec2f>& uvs) {
+        size_t total = 0;
+        for(Vec2f uv : uvs) {
+            uintptr_t lines[16];
+            size_t count = 0;
+            accumulator.touched(uv, [&](const void* address, size_t bytes) {
+                uintptr_t first = reinterpret_cast<uintptr_t>(address) / LINE;
+                uintptr_t last = (reinterpret_cast<uintptr_t>(address) + bytes - 1) / LINE;
+                for(uintptr_t line = first; line <= last; line++) {
+                    if(std::find(lines, lines + count, line) == lines + count) {
+                        lines[count++] = line;
+                    }
+                }
+            });
+            total += count;
+        }
+        return Float(total) / uvs.size();
+    }
+
+    template<typename Accumulator>
+    void bench_accumulator(std::vector<BenchResult>& out, const std::string& name, const std::vector<Vec2f>& scattered, const std::vector<Vec2f>& coherent) {
+        Accumulator accumulator(SIZE);
+        Color value = { 0.5, 0.25, 0.125 };
+
+        out.push_back({ "frame/bytes per pixel " + name, Float(Accumulator::PIXEL_BYTES), "B", false });
+
+        Float scattered_rate = measure_rate(COUNT, [&] {
+            for(Vec2f uv : scattered) accumulator.add_bilinear(uv, value);
+        });
+        Float scattered_lines = lines_per_sample(accumulator, scattered);
+        out.push_back({ "frame/add_bilinear scattered " + name, scattered_rate, "samples" });
+        out.push_back({ "frame/lines per sample " + name, scattered_lines, "lines", false });
+        out.push_back({ "frame/line traffic scattered " + name, scattered_rate * scattered_lines * LINE, "B" });
+
+        out.push_back({ "frame/add_bilinear coherent " + name, measure_rate(COUNT, [&] {
+            for(Vec2f uv : coherent) accumulator.add_bilinear(uv, value);
+        }), "samples" });
+        keep(accumulator);
+    }
+
+    /// Workers splat one jittered sample per pixel into tile buffers and merge them into one
+    /// frame, each starting its walk over the tiles at a different place, as render passes do
+    void bench_merge(std::vector<BenchResult>& out, size_t threads) {
+        const ivec2 size = { 512, 512 };
+        constexpr i32 TILE = 32;
+        i32 tiles_x = size.x / TILE;
+        i32 tiles = tiles_x * (size.y / TILE);
+        Frame frame { size };
+        Color value = { 0.5, 0.25, 0.125 };
+
+        Float rate = measure_rate(threads * size.x * size.y, [&] {
+            std::vector<std::thread> workers;
+            for(size_t t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    Random rng;
+                    TileBuffer buffer;
+                    for(i32 k = 0; k < tiles; k++) {
+                        i32 tile = (k + static_cast<i32>(t) * tiles / static_cast<i32>(threads)) % tiles;
+                        ivec2 begin = { (tile % tiles_x) * TILE, (tile / tiles_x) * TILE };
+                        buffer.reset(begin, { begin.x + TILE, begin.y + TILE });
+                        for(i32 j = begin.y; j < begin.y + TILE; j++) {
+                            for(i32 i = begin.x; i < begin.x + TILE; i++) {
+                                Vec2f jitter = rng.unit2D();
+                                buffer.add_bilinear({ (i + jitter.x) / size.x, (j + jitter.y) / size.y }, size, value);
+                            }
+                        }
+                        frame.merge(buffer);
+                    }
+                });
+            }
+            for(auto& worker : workers) {
+                worker.join();
+            }
+        });
+        std::string name = (threads == 1) ? "1 thread" : std::to_string(threads) + " threads";
+        out.push_back({ "frame/tile merge " + name, rate, "samples" });
+    }
+}
+
+void bench_frame(std::vector<BenchResult>& out) {
+    Random rng;
+
+    // Scattered splats land anywhere in the frame, coherent ones walk 32x32 tiles
+    // one jittered sample per pixel, as tile workers do
+    std::vector<Vec2f> scattered(COUNT);
+    for(auto& uv : scattered) {
+        uv = rng.unit2D();
+    }
+
+    std::vector<Vec2f> coherent;
+    for(i32 tile = 0; coherent.size() < COUNT; tile++) {
+        i32 tx = (tile * 32) % SIZE.x;
+        i32 ty = ((tile * 32) / SIZE.x * 32) % SIZE.y;
+        for(i32 j = 0; j < 32; j++) {
+            for(i32 i = 0; i < 32; i++) {
+                Vec2f jitter = rng.unit2D();
+                coherent.push_back({ (tx + i + jitter.x) / SIZE.x, (ty + j + jitter.y) / SIZE.y });
+            }
+        }
+    }
+    coherent.resize(COUNT);
+
+    bench_accumulator<LegacyAccumulator>(out, "legacy f64", scattered, coherent);
+    bench_accumulator<CompactAccumulator>(out, "rgbw f32", scattered, coherent);
+
+    // Frame::add_bilinear is the direct single thread path, merges are what workers contend on
+    Frame frame { { 512, 512 } };
+    out.push_back({ "frame/Frame::add_bilinear direct", measure_rate(COUNT, [&] {
+        for(Vec2f uv : coherent) frame.add_bilinear(uv, { 0.5, 0.25, 0.125 });
+    }), "samples" });
+
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    bench_merge(out, 1);
+    if(threads > 1) bench_merge(out, threads);
+}
@@ -0,0 +1,40 @@
+#include "core.hpp"
+
+#include <iomanip>
+
+int main(int argc, char** argv) {
+    // --json: print results as a JSON array of { name, value, unit } for tracking runs
+    bool json = false;
+    for(int i = 1; i < argc; i++) {
+        if(std::string(argv[i]) == "--json") json = true;
+    }
+
+    std::vector<BenchResult> results;
+    bench_random(results);
+    bench_frame(results);
+    bench_shapes(results);
+    bench_pathtrace(results);
+
+    if(json) {
+        std::cout << "[\n" << std::setprecision(6);
+        for(size_t i = 0; i < results.size(); i++) {
+            const BenchResult& result = results[i];
+            std::cout << "  { \"name\": \"" << result.name << "\", \"value\": " << result.rate
+                << ", \"unit\": \"" << result.unit << (result.per_second ? "/s" : "") << "\" }"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        std::cout << "]" << std::endl;
+        return 0;
+    }
+
+    for(auto& result : results) {
+        std::cout << std::left << std::setw(40) << result.name << std::right << std::setw(12) << std::setprecision(4);
+        if(result.per_second) {
+            std::cout << result.rate / 1e6 << " M" << result.unit << "/s\n";
+        }
+        else {
+            std::cout << result.rate << " " << result.unit << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include "core.hpp"
+#include "../shapes/core.hpp"
+
+void bench_pathtrace(std::vector<BenchResult>& out) {
+    constexpr size_t COUNT = 1024;
+
+    std::vector<const Shape*> lights;
+    ShapeList scene = cornell_box(lights);
+    BakedScene baked { scene, {
+        .method = BVHBuild::Binned,
+        .max_leaf = 8,
+        .intersect_cost = 1.0 / simd::WIDTH
+    } };
+
+    // Camera rays of main's camera through random points of a square frame
+    Random rng;
+    std::vector<Ray> rays(COUNT);
+    for(auto& ray : rays) {
+        Vec2f uv = rng.unit2D();
+        Vec3f screen = { 2.0 * uv.x - 1.0, 2.0 * uv.y - 1.0, 1.0 };
+        ray = { .pos = Vec3f(0.0, 0.0, -0.95), .dir = screen.unit() };
+    }
+
+    auto bench = [&](const std::string& name, const Shape& shape) {
+        Integrator solver;
+        solver.scene = &shape;
+        solver.lights = lights;
+
+        Spectrum sum = Colors::BLACK;
+        out.push_back({ "path/pathtrace cornell box " + name, measure_rate(COUNT, [&] {
+            for(const Ray& ray : rays) {
+                sum += solver.pathtrace(ray);
+            }
+            keep(sum);
+        }), "paths" });
+        out.push_back({ "path/segments per path " + name, solver.stats.mean_length(), "segments", false });
+    };
+    bench("BakedScene", baked);
+    bench("ShapeList", scene);
+}
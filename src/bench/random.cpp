@@ -0,0 +1,67 @@
+#include "core.hpp"
+
+namespace {
+    /// Random as it was before bit manipulated floats: distribution objects,
+    /// and directions from normalized Gaussian triples
+    struct LegacyRandom {
+        pcg32 rng;
+        std::uniform_real_distribution<Float> dist { 0.0, 1.0 };
+        std::normal_distribution<Float> dist2 { 0.0, 1.0 };
+
+        Float unit() {
+            return dist(rng);
+        }
+        Vec3f sample_sphere() {
+            return Vec3f(dist2(rng), dist2(rng), dist2(rng)).unit();
+        }
+        Vec3f sample_cos_hemisphere(Vec3f normal) {
+            return (sample_sphere() + normal).unit();
+        }
+    };
+
+    constexpr size_t COUNT = 4096;
+}
+
+void bench_random(std::vector<BenchResult>& out) {
+    LegacyRandom legacy;
+    Random rng;
+    Vec3f normal = Vec3f(1.0, 2.0, 3.0).unit();
+
+    std::vector<Float> values(COUNT);
+    std::vector<Vec3f> dirs(COUNT);
+
+    out.push_back({ "random/unit legacy", measure_rate(COUNT, [&] {
+        for(auto& value : values) value = legacy.unit();
+        keep(values[0]);
+    }), "samples" });
+    out.push_back({ "random/unit", measure_rate(COUNT, [&] {
+        for(auto& value : values) value = rng.unit();
+        keep(values[0]);
+    }), "samples" });
+    out.push_back({ "random/unit batched", measure_rate(COUNT, [&] {
+        rng.fill_unit(values.data(), COUNT);
+        keep(values[0]);
+    }), "samples" });
+
+    out.push_back({ "random/sphere legacy", measure_rate(COUNT, [&] {
+        for(auto& dir : dirs) dir = legacy.sample_sphere();
+        keep(dirs[0]);
+    }), "samples" });
+    out.push_back({ "random/sphere", measure_rate(COUNT, [&] {
+        for(auto& dir : dirs) dir = rng.sample_sphere();
+        keep(dirs[0]);
+    }), "samples" });
+    out.push_back({ "random/sphere batched", measure_rate(COUNT, [&] {
+        rng.fill_sphere(dirs.data(), COUNT);
+        keep(dirs[0]);
+    }), "samples" });
+
+    out.push_back({ "random/cos_hemisphere legacy", measure_rate(COUNT, [&] {
+        for(auto& dir : dirs) dir = legacy.sample_cos_hemisphere(normal);
+        keep(dirs[0]);
+    }), "samples" });
+    out.push_back({ "random/cos_hemisphere", measure_rate(COUNT, [&] {
+        for(auto& dir : dirs) dir = rng.sample_cos_hemisphere(normal);
+        keep(dirs[0]);
+    }), "samples" });
+}
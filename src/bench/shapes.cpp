@@ -0,0 +1,56 @@
+#include "core.hpp"
+#include "../shapes/core.hpp"
+
+namespace {
+    constexpr size_t COUNT = 4096;
+
+    /// Rays from a sphere of radius 4 toward points of [-1, 1]^3, so a shape
+    /// near the origin is hit by some and missed by the rest
+    std::vector<Ray> make_rays(Random& rng) {
+        std::vector<Ray> rays(COUNT);
+        for(auto& ray : rays) {
+            Vec3f pos = 4.0 * Vec3f(rng.sample_sphere());
+            Vec3f target = { 2.0 * rng.unit() - 1.0, 2.0 * rng.unit() - 1.0, 2.0 * rng.unit() - 1.0 };
+            ray = { .pos = pos, .dir = (target - pos).unit() };
+        }
+        return rays;
+    }
+
+    void bench_intersect(std::vector<BenchResult>& out, const std::string& name, const Shape& shape, const std::vector<Ray>& rays) {
+        size_t hits = 0;
+        out.push_back({ "shapes/intersect " + name, measure_rate(rays.size(), [&] {
+            for(const Ray& ray : rays) {
+                hits += shape.intersect(ray).hit;
+            }
+            keep(hits);
+        }), "rays" });
+    }
+}
+
+void bench_shapes(std::vector<BenchResult>& out) {
+    Random rng;
+    std::vector<Ray> rays = make_rays(rng);
+    Unit<Vec3f> up = Vec3f(0.0, 1.0, 0.0).unit();
+
+    bench_intersect(out, "Sphere", *Sphere{}.with_pos({ 0.0, 0.0, 0.0 }).with_radius(0.5).build(), rays);
+    bench_intersect(out, "Plane", *Plane{}.with_pos({ 0.0, 0.0, 0.0 }).with_dir(up).build(), rays);
+    bench_intersect(out, "Disc", *Disc{}.with_pos({ 0.0, 0.0, 0.0 }).with_dir(up).with_radius(0.5).build(), rays);
+    bench_intersect(out, "Diamond", *Diamond{}.with_pos({ 0.0, 0.0, 0.0 }).with_a({ 0.5, 0.0, 0.0 }).with_b({ 0.0, 0.0, 0.5 }).build(), rays);
+
+    // Linear lists against the virtual and the baked BVH over the same spheres
+    ShapeList list;
+    for(size_t size : { 1, 4, 16, 64, 256 }) {
+        while(list.data.size() < size) {
+            Vec3f pos = { 2.0 * rng.unit() - 1.0, 2.0 * rng.unit() - 1.0, 2.0 * rng.unit() - 1.0 };
+            list.add(Sphere{}.with_pos(pos).with_radius(0.05 + 0.15 * rng.unit()).build());
+        }
+        std::string count = std::to_string(size) + " spheres";
+        bench_intersect(out, "ShapeList " + count, list, rays);
+
+        BVH bvh { list };
+        bench_intersect(out, "BVH " + count, bvh, rays);
+
+        BakedScene baked { list };
+        bench_intersect(out, "BakedScene " + count, baked, rays);
+    }
+}
@@ -1,23 +1,57 @@
 #pragma once
 #include "prelude.hpp"
 #include "graphics/core.hpp"
+#include "telemetry.hpp"
 #include "pcg_random.hpp"
 
+#include <algorithm>
+#include <bit>
 #include <exception>
 #include <random>
 
+/// Two directions completing `normal` to an orthonormal basis (Duff et al. 2017)
+static std::pair<Vec3f, Vec3f> tangents(Vec3f normal) {
+    Float sign = std::copysign(Float(1), normal.z);
+    Float a = -1.0 / (sign + normal.z);
+    Float b = normal.x * normal.y * a;
+    return {
+        { 1.0 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x },
+        { b, sign + normal.y * normal.y * a, -normal.y }
+    };
+}
+
+static Vec3f sample_sphere(Vec2f u) {
+    Float z   = 1 - 2 * u.x;
+    Float r   = std::sqrt(std::max(Float(0), 1.0 - z * z));
+    Float phi = 2 * M_PI * u.y;
+
+    return { r * std::cos(phi), r * std::sin(phi), z };
+}
+/// Malley's method: uniform points on the unit disc lifted onto the hemisphere
+static Vec3f sample_cos_hemisphere(Vec2f u, Vec3f normal) {
+    Float r   = std::sqrt(u.x);
+    Float phi = 2 * M_PI * u.y;
+    Float z   = std::sqrt(std::max(Float(0), 1.0 - u.x));
+
+    auto [s, t] = tangents(normal);
+    return r * std::cos(phi) * s + r * std::sin(phi) * t + z * normal;
+}
+
 struct Random {
     pcg32 rng;
-    std::uniform_real_distribution<Float> dist;
-    std::normal_distribution<Float> dist2;
 
-    Random(): dist(0.0, 1.0), dist2(0.0, 1.0) {
+    Random() {
         std::random_device device;
         rng.seed(device());
     }
 
+    /// Uniform in [0, 1), 32 random bits placed in the mantissa of a float in [1, 2)
+    static Float to_unit(u32 bits) {
+        return std::bit_cast<Float>(0x3ff0000000000000ull | (u64(bits) << 20)) - 1.0;
+    }
+
     Float unit() {
-        return dist(rng);
+        return to_unit(rng());
     }
 
     Vec2f unit2D(){
@@ -31,16 +65,69 @@ struct Random {
     }
 
     Vec3f sample_ball() {
-        return Vec3f(dist2(rng), dist2(rng), dist2(rng));
+        return std::cbrt(unit()) * sample_sphere();
     }
     Vec3f sample_sphere() {
-        return sample_ball().unit();
+        return ::sample_sphere(unit2D());
     }
     Vec3f sample_hemisphere(Vec3f normal) {
         return sample_sphere().facing(normal);
     }
     Vec3f sample_cos_hemisphere(Vec3f normal) {
-        return (sample_sphere() + normal).unit();
+        return ::sample_cos_hemisphere(unit2D(), normal);
+    }
+
+    /// Batched variants: random bits are drawn first, then converted in a
+    /// separate loop without dependencies between iterations, which vectorizes
+    void fill_unit(Float* out, size_t count) {
+        constexpr size_t CHUNK = 256;
+        u32 bits[CHUNK];
+        for(size_t begin = 0; begin < count; begin += CHUNK) {
+            size_t n = std::min(CHUNK, count - begin);
+            for(size_t i = 0; i < n; i++) {
+                bits[i] = rng();
+            }
+            for(size_t i = 0; i < n; i++) {
+                out[begin + i] = to_unit(bits[i]);
+            }
+        }
+    }
+    void fill_sphere(Vec3f* out, size_t count) {
+        constexpr size_t CHUNK = 128;
+        Float u[2 * CHUNK];
+        for(size_t begin = 0; begin < count; begin += CHUNK) {
+            size_t n = std::min(CHUNK, count - begin);
+            fill_unit(u, 2 * n);
+            for(size_t i = 0; i < n; i++) {
+                out[begin + i] = ::sample_sphere({ u[2 * i], u[2 * i + 1] });
+            }
+        }
+    }
+};
+
+/// Hands out the values of one pixel sample, one dimension at a time
+/// Implementations differ in how values are spread over samples and pixels
+struct Sampler {
+    virtual ~Sampler() {}
+
+    /// Starts sample `index` of pixel (x, y) at dimension `dim`
+    virtual void start(u32 x, u32 y, u32 index, u32 dim = 0) = 0;
+
+    /// Next dimension, as one value or as a 2D point in [0, 1)
+    virtual Float get1D() = 0;
+    virtual Vec2f get2D() = 0;
+};
+
+/// Independent uniforms, ignoring pixel and index, the baseline for other samplers
+struct RandomSampler : public Sampler {
+    Random rng;
+
+    void start(u32 x, u32 y, u32 index, u32 dim = 0) override {}
+    Float get1D() override {
+        return rng.unit();
+    }
+    Vec2f get2D() override {
+        return rng.unit2D();
     }
 };
 
@@ -49,6 +136,14 @@ struct Ray {
     Unit<Vec3f> dir;
 };
 
+/// Coherent bundle of rays, such as a 4x4 block of camera rays
+struct RayPacket {
+    static constexpr size_t SIZE = 16;
+
+    Ray rays[SIZE];
+    size_t count = 0;
+};
+
 using Spectrum = Color;
 
 struct Material;
@@ -59,30 +154,31 @@ struct LocalSurface {
     const Material* material = nullptr;
 };
 
-static Vec3f sample_sphere(Vec2f u) {
-    Float z   = 1 - 2 * u.x;
-    Float r   = std::sqrt(std::max(Float(0), 1.0 - z * z));
-    Float phi = 2 * M_PI * u.y;
-
-    return { r * std::cos(phi), r * std::sin(phi), z };
-}
-
 struct Material {
     Spectrum diffuse  = Spectrum(1.0);
     Spectrum specular = Spectrum(0.0);
     Spectrum emission = Spectrum(0.0);
 
     Float prob_specular = 0.0;
-    std::pair<Ray, Spectrum> sample_f(Random* rng, const LocalSurface* surface) const {
+    std::pair<Ray, Spectrum> sample_f(Sampler* sampler, const LocalSurface* surface) const {
         Ray new_ray;
         new_ray.pos = surface->pos + 0.0001 * surface->normal;
-        new_ray.dir = rng->sample_cos_hemisphere(surface->normal);
+        new_ray.dir = sample_cos_hemisphere(sampler->get2D(), surface->normal);
 
         Float cos_theta = new_ray.dir.dot(surface->normal);
         Spectrum output = diffuse;
 
         return { new_ray, output };
     };
+
+    /// BSDF value towards `dir`, sample_f picks directions in proportion to f * cos
+    Spectrum f(const LocalSurface* surface, Vec3f dir) const {
+        return diffuse * M_1_PI;
+    }
+    /// Solid angle density with which sample_f picks `dir`
+    Float pdf(const LocalSurface* surface, Vec3f dir) const {
+        return std::max(Float(0), dir.dot(surface->normal)) * M_1_PI;
+    }
 };
 
 
@@ -92,15 +188,87 @@ struct Intersection {
     bool hit = false;
 };
 
+/// Features of the first surface a path hits, guides for denoising
+/// Misses leave the defaults, with depth 0
+struct FirstHit {
+    Spectrum albedo = Colors::BLACK;
+    Vec3f normal = { 0.0, 0.0, 0.0 };
+    Float depth = 0.0;
+
+    static FirstHit from(const Intersection& hit) {
+        if(!hit.hit) return {};
+        return { hit.local.material->diffuse, hit.local.normal, hit.dist };
+    }
+};
+
+/// Point on the surface of a shape, `pdf` is per unit area
+struct SurfaceSample {
+    LocalSurface local = {};
+    Float pdf = 0.0;
+};
+
+struct Shape;
+
+/// Nearest hit without surface data, cheap to produce and throw away
+/// `shape` is the primitive hit, `prim` is free for it to use in surface_at
+struct Hit {
+    Float dist = INFINITY;
+    const Shape* shape = nullptr;
+    u32 prim = 0;
+};
+
 struct Shape {
     virtual ~Shape() {}
     virtual void format(std::ostream& out, size_t indent) const {
         out << "Shape";
     }
     virtual void draw(Canvas& cnv) const {};
-    virtual Intersection intersect(Ray ray) const { 
+
+    /// Nearest hit closer than `tmax`, `shape` is null on a miss
+    virtual Hit hit(const Ray& ray, Float tmax) const { 
         throw std::logic_error("Shape: No intersection implemented!");
     };
+    /// Surface data of a hit returned by `hit`, built once per ray
+    virtual LocalSurface surface_at(const Ray& ray, const Hit& hit) const {
+        throw std::logic_error("Shape: No surface implemented!");
+    };
+
+    /// Whether anything is hit closer than `tmax`, stopping at the first hit found
+    virtual bool occluded(const Ray& ray, Float tmax) const {
+        return hit(ray, tmax).shape != nullptr;
+    }
+
+    Intersection intersect(Ray ray) const {
+        Hit nearest = hit(ray, INFINITY);
+        if(!nearest.shape) return { .hit = false };
+
+        return {
+            .local = nearest.shape->surface_at(ray, nearest),
+            .dist  = nearest.dist,
+            .hit   = true
+        };
+    }
+
+    /// Intersects `packet.count` rays, writing one result per ray to `hits`
+    virtual void intersect_packet(const RayPacket& packet, Intersection* hits) const {
+        for(size_t i = 0; i < packet.count; i++) {
+            hits[i] = intersect(packet.rays[i]);
+        }
+    }
+
+    /// Uniformly distributed point on the surface, used to sample area lights
+    virtual SurfaceSample sample_point(Vec2f u) const {
+        throw std::logic_error("Shape: No sampling implemented!");
+    }
+    /// Area density of sample_point at `pos`, a point on the surface
+    virtual Float pdf(Vec3f pos) const {
+        throw std::logic_error("Shape: No sampling implemented!");
+    }
+
+    /// Unbounded shapes (default) are kept out of acceleration structures
+    virtual Bounds3f bounds() const {
+        return Bounds3f::infinite();
+    }
 };
 
 struct Scene : public Shape {
@@ -114,31 +282,142 @@ inline std::ostream& operator<<(std::ostream& out, const Shape* shape) {
 }
 
 
+/// Power heuristic weight of a sample drawn with density `pdf`,
+/// given another strategy that draws it with density `other`
+inline Float mis_weight(Float pdf, Float other) {
+    if(pdf <= 0.0) return 0.0;
+    return (pdf * pdf) / (pdf * pdf + other * other);
+}
+
+/// Solid angle density with which sample_direct picks the emitter `hit` by `ray`
+inline Float light_pdf(const std::vector<const Shape*>& lights, const Ray& ray, const Intersection& hit) {
+    Float pdf = 0.0;
+    for(const Shape* light : lights) {
+        // The hit belongs to this light if the light is hit at the same distance
+        Hit found = light->hit(ray, hit.dist * (1.0 + 1e-6));
+        if(!found.shape || found.dist < hit.dist * (1.0 - 1e-6)) continue;
+
+        Float cos_light = std::abs(ray.dir.dot(hit.local.normal));
+        pdf += light->pdf(hit.local.pos) * hit.dist * hit.dist / cos_light;
+    }
+    return lights.empty() ? 0.0 : pdf / lights.size();
+}
+
+/// Next event estimation: light arriving at `surface` from a point sampled on one
+/// uniformly chosen light, through the surface BSDF and weighted against BSDF sampling
+inline Spectrum sample_direct(Sampler* sampler, const Shape* scene, const std::vector<const Shape*>& lights, const LocalSurface* surface) {
+    if(lights.empty()) return Colors::BLACK;
+
+    size_t index = std::min(lights.size() - 1, static_cast<size_t>(sampler->get1D() * lights.size()));
+    SurfaceSample sample = lights[index]->sample_point(sampler->get2D());
+
+    // Same offset as the rays of Material::sample_f
+    Vec3f origin = surface->pos + 0.0001 * surface->normal;
+    Vec3f to_light = sample.local.pos - origin;
+    Float dist = to_light.norm();
+    Vec3f dir = to_light / dist;
+
+    Float cos_surface = dir.dot(surface->normal);
+    Float cos_light = std::abs(dir.dot(sample.local.normal));
+    if(cos_surface <= 0.0 || cos_light <= 0.0) return Colors::BLACK;
+
+    bool occluded = scene->occluded({ origin, dir }, dist * (1.0 - 1e-4));
+    telemetry::count(telemetry::Rays);
+    telemetry::count(occluded ? telemetry::Hits : telemetry::Misses);
+    if(occluded) return Colors::BLACK;
+
+    const Material* material = surface->material;
+    Float pdf = sample.pdf * dist * dist / cos_light / lights.size();
+    Float weight = mis_weight(pdf, material->pdf(surface, dir));
+
+    return (weight * cos_surface / pdf) * material->f(surface, dir) * sample.local.material->emission;
+}
+
+/// Russian roulette on path throughput, survivors are scaled up to stay unbiased
+/// Returns false if the path should terminate
+inline bool survive_roulette(Sampler* sampler, Spectrum& throughput) {
+    Float p = std::min(Float(0.95), std::max({ throughput.r, throughput.g, throughput.b }));
+    if(sampler->get1D() >= p) return false;
+
+    throughput *= 1.0 / p;
+    return true;
+}
+
+/// Path length counters, segments include the camera ray but not shadow rays
+struct PathStats {
+    u64 paths = 0;
+    u64 segments = 0;
+
+    Float mean_length() const {
+        return (paths > 0) ? Float(segments) / Float(paths) : 0.0;
+    }
+    PathStats& operator+=(const PathStats& rhs) {
+        paths += rhs.paths;
+        segments += rhs.segments;
+        return *this;
+    }
+};
+
 struct Integrator {
-    Random rng;
+    RandomSampler random;
+    /// Source of sample values, `random` unless set
+    /// Callers start the sampler on the pixel sample before pathtrace
+    Sampler* sampler = nullptr;
+
     const Shape* scene;
     std::vector<const Shape*> lights;
 
+    /// Bounces traced before Russian roulette starts, and the hard limit
+    size_t min_depth = 3;
+    size_t max_depth = 10;
+    PathStats stats;
+
     Integrator() {}
 
     Spectrum pathtrace(Ray ray) {
+        return pathtrace(ray, scene->intersect(ray));
+    }
+
+    /// Continues a path whose first intersection is already known,
+    /// such as a camera ray traced as part of a packet
+    /// Features of that intersection go to `first` if it is set
+    Spectrum pathtrace(Ray ray, Intersection hit, FirstHit* first = nullptr) {
+        Sampler* sampler = this->sampler ? this->sampler : &random;
+        if(first) *first = FirstHit::from(hit);
+
         Spectrum lum = Colors::BLACK;
         Spectrum BSDF_prod = Colors::WHITE;
+        Float BSDF_pdf = 0.0;
 
-        for(size_t i = 0; i < 10; i++) {
-            Intersection hit = scene->intersect(ray);
+        stats.paths++;
+        u64 segments = stats.segments;
+        for(size_t i = 0; i < max_depth; i++) {
+            if(i > 0) hit = scene->intersect(ray);
+            stats.segments++;
 
+            telemetry::count(telemetry::Rays);
+            telemetry::count(hit.hit ? telemetry::Hits : telemetry::Misses);
             if(!hit.hit) break;
 
             const LocalSurface* surface = &hit.local;
-            auto [new_ray, BSDF] = surface->material->sample_f(&rng, surface);
+            const Spectrum& emission = surface->material->emission;
+
+            // Emitters seen directly are not light sampled, later hits share with sample_direct
+            if(emission.norm_squared() > 0.0) {
+                Float weight = (i == 0) ? 1.0 : mis_weight(BSDF_pdf, light_pdf(lights, ray, hit));
+                lum += weight * BSDF_prod * emission;
+            }
+            lum += BSDF_prod * sample_direct(sampler, scene, lights, surface);
 
-            lum += BSDF_prod * surface->material->emission;
+            auto [new_ray, BSDF] = surface->material->sample_f(sampler, surface);
+            BSDF_pdf = surface->material->pdf(surface, new_ray.dir);
             BSDF_prod *= BSDF;
 
+            if(i + 1 >= min_depth && !survive_roulette(sampler, BSDF_prod)) break;
             ray = new_ray;
         }
 
+        telemetry::path_length(stats.segments - segments);
         return lum;
     }
 };
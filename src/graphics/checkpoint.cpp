@@ -0,0 +1,116 @@
+#include "core.hpp"
+#include <cstddef>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string& path, size_t size) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        std::cerr << "Error: Cannot open file [" << path << "]" << std::endl;
+        return false;
+    }
+
+    struct stat info;
+    m_resized = fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) != size;
+    if(m_resized && ftruncate(fd, size) != 0) {
+        std::cerr << "Error: Cannot resize file [" << path << "]" << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping keeps the file open, the descriptor is no longer needed
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED) {
+        std::cerr << "Error: Cannot map file [" << path << "]" << std::endl;
+        return false;
+    }
+
+    m_data = static_cast<u8*>(data);
+    m_size = size;
+    return true;
+}
+void MappedFile::close() {
+    if(!m_data) return;
+    munmap(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+}
+void MappedFile::sync() {
+    if(m_data) msync(m_data, m_size, MS_SYNC);
+}
+
+
+
+namespace {
+    /// First page of a checkpoint file, the grids of Frame::Layout follow it
+    /// Everything up to `passes` must match for the file to be resumed
+    struct CheckpointHeader {
+        char magic[8];
+        u64 scene_hash;
+        i32 width;
+        i32 height;
+        u64 tiles;
+        u32 features;
+        /// Passes every tile has, informational, the per tile counts are what resume uses
+        u32 passes;
+    };
+    constexpr char MAGIC[8] = { 'P', 'S', 'C', 'K', 'P', 'T', '0', '1' };
+    constexpr size_t HEADER_BYTES = 4096;
+}
+
+bool Frame::open_checkpoint(const std::string& path, u64 scene_hash, size_t tiles) {
+    // The grids are copied out of their current block, which must still be mapped
+    if(m_checkpoint.is_open()) {
+        std::cerr << "Error: Frame already has a checkpoint [" << path << "]" << std::endl;
+        return false;
+    }
+    Layout file = layout(tiles, has_features(), HEADER_BYTES);
+    if(!m_checkpoint.open(path, file.total)) return false;
+
+    CheckpointHeader expected = {};
+    std::memcpy(expected.magic, MAGIC, sizeof(MAGIC));
+    expected.scene_hash = scene_hash;
+    expected.width = size.x;
+    expected.height = size.y;
+    expected.tiles = tiles;
+    expected.features = file.features;
+
+    u8* base = m_checkpoint.data();
+    auto* header = reinterpret_cast<CheckpointHeader*>(base);
+    bool resume = !m_checkpoint.resized()
+        && std::memcmp(header, &expected, offsetof(CheckpointHeader, passes)) == 0;
+
+    // Anything else is overwritten, with the samples taken so far and no tile progress
+    if(!resume) {
+        std::memset(base, 0, file.total);
+        copy_grids(base, file);
+        *header = expected;
+        m_checkpoint.sync();
+    }
+
+    m_storage.reset();
+    bind(base, file);
+    for(auto& dirty : m_dirty) {
+        dirty = 1;
+    }
+    return true;
+}
+
+void Frame::checkpoint() {
+    if(!m_checkpoint.is_open()) return;
+
+    u32 passes = m_progress.empty() ? 0 : *std::min_element(m_progress.begin(), m_progress.end());
+    reinterpret_cast<CheckpointHeader*>(m_checkpoint.data())->passes = passes;
+    m_checkpoint.sync();
+}
@@ -4,6 +4,10 @@
 #include <epoxy/gl.h>
 #include <GLFW/glfw3.h>
 
+#include <functional>
+#include <mutex>
+#include <span>
+
 
 
 GLuint load_shader(std::string path, GLenum type);
@@ -78,6 +82,7 @@ struct Window {
 
     bool should_close();
     void update();
+    void set_title(const std::string& title);
 
     dvec2 get_mouse_pos();
     ivec2 inner_size();
@@ -169,6 +174,12 @@ struct Grid2D {
     , size(size)
     {} 
 
+    /// Reuses the allocation when it is large enough
+    void resize(ivec2 new_size, T fill) {
+        data.assign(new_size.x * new_size.y, fill);
+        size = new_size;
+    }
+
     T& get(i32 i, i32 j) {
         return data[i + size.x * j];
     }
@@ -177,6 +188,17 @@ struct Grid2D {
     }
 };
 
+/// Grid over memory owned elsewhere, such as a block shared by several grids or a mapped file
+template<typename T>
+struct GridSpan {
+    std::span<T> data;
+    ivec2 size = { 0, 0 };
+
+    T& get(i32 i, i32 j) const {
+        return data[i + size.x * j];
+    }
+};
+
 struct RGB {
     f32 r;
     f32 g;
@@ -190,30 +212,353 @@ struct RGB {
         };
     }
 };
+/// Weighted color sums and their shared weight, one 16 byte slot per pixel
+/// Frames accumulate in f32, with tile buffers summing each pass in f64 first, so a
+/// pixel takes a few rounded adds per pass rather than one per sample. The relative
+/// rounding error then grows at most as passes * 2^-24, about 1e-3 after 16k passes
+/// and well under the Monte Carlo noise of that many samples
+struct alignas(16) RGBW {
+    f32 r;
+    f32 g;
+    f32 b;
+    f32 w;
+};
+
+/// Splits a sample at `uv` over the four pixel centres around it with tent filter
+/// weights, calling add(i, j, weight) for pixels of a `size` grid (possibly outside it)
+template<typename Fn>
+void splat_bilinear(Vec2f uv, ivec2 size, Fn add) {
+    Float px = uv.x * static_cast<Float>(size.x) - 0.5;
+    Float py = uv.y * static_cast<Float>(size.y) - 0.5;
+    Float fx = std::floor(px);
+    Float fy = std::floor(py);
+
+    i32 pi = static_cast<i32>(fx);
+    i32 pj = static_cast<i32>(fy);
+    Float wx[] = { Float(1) - (px - fx), px - fx };
+    Float wy[] = { Float(1) - (py - fy), py - fy };
+
+    for(i32 j = 0; j < 2; j++) {
+        for(i32 i = 0; i < 2; i++) {
+            add(pi + i, pj + j, wx[i] * wy[j]);
+        }
+    }
+}
+
+/// parallel_for(count, fn) runs fn(i) for i in [0, count), possibly on several threads
+using ParallelFor = std::function<void(size_t count, const std::function<void(size_t)>& fn)>;
+
+/// First hit guides of a pixel, weighted sums while accumulating and averages once resolved
+struct Features {
+    Color albedo = Colors::BLACK;
+    Vec3f normal = { 0.0, 0.0, 0.0 };
+    Float depth = 0.0;
+};
+
+/// Weighted sums for one tile and a one pixel halo, owned by a single thread
+/// Samples land here without synchronization and are merged into a Frame per tile
+struct TileBuffer {
+    /// Frame position of the buffer's first pixel
+    ivec2 begin = { 0, 0 };
+    Grid2D<Float> weight = Grid2D<Float>({ 0, 0 }, 0.0);
+    Grid2D<Color> sum    = Grid2D<Color>({ 0, 0 }, Colors::BLACK);
+    /// Weighted sum of squared luminance, for noise estimates
+    Grid2D<Float> sum_sq = Grid2D<Float>({ 0, 0 }, 0.0);
+    /// Camera samples taken per pixel
+    Grid2D<u32> samples = Grid2D<u32>({ 0, 0 }, 0);
+    /// Only kept when `with_features` is set, for frames that denoise
+    bool with_features = false;
+    Grid2D<Features> features = Grid2D<Features>({ 0, 0 }, {});
+
+    /// Clears the buffer to cover the tile [tile_begin, tile_end) and its halo
+    void reset(ivec2 tile_begin, ivec2 tile_end);
+
+    /// Frame pixel coordinates, samples outside the buffer are dropped
+    void add_sample(i32 i, i32 j, Color color, Float weight);
+    void add_bilinear(Vec2f uv, ivec2 frame_size, Color color);
+    void count_sample(i32 i, i32 j);
+    void add_features(Vec2f uv, ivec2 frame_size, const Features& value);
+};
+
+/// Display transform applied in shaders/frame.frag, after exposure
+/// Reinhard and ACES output sRGB encoded values, None shows linear values clamped
+enum class Tonemap : i32 { None, Reinhard, ACES };
+
+/// CPU copy of the shaders/frame.frag display transform, for image output
+RGB display_transform(RGB linear, f32 exposure, Tonemap tonemap);
+
+/// Image writers take frame rows, bottom to top, and return false if the file cannot be written
+/// Linear float Portable Float Map
+bool save_pfm(const std::string& path, const Grid2D<RGB>& image);
+/// Linear float OpenEXR, uncompressed scanlines
+bool save_exr(const std::string& path, const Grid2D<RGB>& image);
+/// 8 bit RGB after the display transform, stored in uncompressed deflate blocks
+bool save_png(const std::string& path, const Grid2D<RGB>& image, f32 exposure, Tonemap tonemap);
+/// Picks the writer by the extension of `path`: .pfm, .exr or .png
+bool save_image(const std::string& path, const Grid2D<RGB>& image, f32 exposure, Tonemap tonemap);
+
+/// Tiled OpenEXR written a tile at a time, from any thread and in any order, so an image
+/// far larger than memory is saved as it renders. Tiles are frame tiles of `tile_size`
+/// counted from the bottom left, with frame rows bottom to top. EXR tiles count from the
+/// top, so the data window reaches above the image to line them up, by less than a tile
+/// of black rows outside the display window
+struct TiledExrWriter {
+    bool open(const std::string& path, ivec2 size, i32 tile_size);
+    /// `pixels` is the frame tile starting at `begin`, clipped to the image
+    bool write_tile(ivec2 begin, const Grid2D<RGB>& pixels);
+    /// Tiles never written are filled in black, readers need all of them
+    bool close();
+
+private:
+    bool write_chunk(i32 tx, i32 ty, const std::vector<f32>& data);
+
+    std::mutex m_mutex;
+    std::ofstream m_file;
+    ivec2 m_size;
+    i32 m_tile;
+    ivec2 m_tiles;
+    /// First data window row, 0 or negative: the window starts above the image by
+    /// the padding of a partial tile row, so EXR tiles line up with frame tiles
+    i32 m_top;
+    u64 m_table;
+    std::vector<bool> m_written;
+};
+
+/// Edge avoiding A-trous wavelet filter (Dammertz et al. 2010) guided by first hit features
+/// Color is divided by albedo before filtering and multiplied back after, so texture
+/// detail is kept. Buffers are planes of floats, each row filtered in contiguous runs
+struct Denoiser {
+    u32 iterations = 5;
+    /// Relative luminance difference, halved every iteration
+    f32 sigma_color = 1.0;
+    f32 sigma_normal = 0.3;
+    f32 sigma_albedo = 0.1;
+    /// Depth difference over the summed depth of both pixels, per pixel of tap distance
+    f32 sigma_depth = 0.01;
+
+    /// Filters `color` into `out`, rows in parallel when `parallel_for` is set
+    void run(const Grid2D<RGB>& color, const Grid2D<Features>& features, Grid2D<RGB>& out, const ParallelFor& parallel_for = nullptr);
+
+private:
+    void filter_row(i32 y, i32 step, f32 inv_color);
+
+    ivec2 m_size = { 0, 0 };
+    std::vector<f32> m_albedo[3];
+    std::vector<f32> m_normal[3];
+    std::vector<f32> m_depth;
+
+    std::vector<f32> m_color[3];
+    std::vector<f32> m_next[3];
+    std::vector<f32> m_lum;
+};
+
+/// Sample counts on a blue to red ramp scaled to the largest count, for display as linear values
+Grid2D<RGB> sample_heatmap(GridSpan<const u32> samples);
+
+/// Shared read and write mapping of a whole file, unmapped on destruction
+/// Stores reach the file through the page cache, so they survive the process
+/// being killed, sync() makes them survive the machine going down as well
+struct MappedFile {
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// Creates the file or resizes it to `size` bytes, new bytes read as zero
+    /// Returns false with a message if the file cannot be mapped
+    bool open(const std::string& path, size_t size);
+    void close();
+    /// Blocks until the mapped pages are written to the file
+    void sync();
+
+    bool is_open() const {
+        return m_data != nullptr;
+    }
+    /// Whether open() had to create the file or change its size
+    bool resized() const {
+        return m_resized;
+    }
+    u8* data() const {
+        return m_data;
+    }
+
+private:
+    u8* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_resized = false;
+};
+
 struct Frame {
+    /// Side of the regions tracked for resolve
+    static constexpr i32 DIRTY_TILE = 32;
+    /// Regions render() resolves and uploads per call, the rest wait for the next
+    /// frames, so the UI frame time does not grow with resolution
+    static constexpr size_t UPLOAD_BUDGET = 256;
+
+    /// GL objects are created by the first render(), so a frame without a
+    /// window can accumulate, resolve and be saved
     Frame(ivec2 size);
     ~Frame();
 
-    void render();
+    void render(const ParallelFor& parallel_for = nullptr);
+    /// Not safe while samples are being added
     void reset() {
-        for(size_t i = 0; i < m_weight.data.size(); i++) {
-            m_weight.data[i] = 0.0;
+        std::fill(m_accum.data.begin(), m_accum.data.end(), RGBW { 0.0, 0.0, 0.0, 0.0 });
+        std::fill(m_sum_sq.data.begin(), m_sum_sq.data.end(), 0.0f);
+        std::fill(m_samples.data.begin(), m_samples.data.end(), 0);
+        std::fill(m_feature_sum.data.begin(), m_feature_sum.data.end(), Features {});
+        std::fill(m_progress.begin(), m_progress.end(), 0);
+        for(auto& dirty : m_dirty) {
+            dirty = 1;
         }
     }
 
     ivec2 get_size() const {
         return size;
     }
+    /// Direct accumulation, for a single thread
+    /// Every sample is rounded into the f32 sums, unlike merged tile buffers
     void add_sample(i32 i, i32 j, Color color, Float weight);
-    void add_bilinear(Vec2f pixel, Color color);
+    void add_bilinear(Vec2f uv, Color color);
+
+    /// Adds the sums of a tile buffer with atomic adds, safe to call from any thread
+    /// Only halo pixels are shared between tiles rendered at the same time
+    void merge(const TileBuffer& tile);
+    /// Adds the sums of a frame of the same size and features, such as one rendered by
+    /// another process. Not safe while tiles are merged
+    void merge(const Frame& other);
+    /// Weighted sums, second moments, sample counts and feature sums as raw bytes,
+    /// laid out the same in every frame of equal size and features
+    /// The writable view lets a frame take sums received from elsewhere
+    std::span<u8> get_sums() {
+        return { m_base + m_layout.accum, m_layout.total - m_layout.accum };
+    }
+    std::span<const u8> get_sums() const {
+        return { m_base + m_layout.accum, m_layout.total - m_layout.accum };
+    }
+
+    /// Converts the weighted sums of regions changed since the last resolve into
+    /// display values, at most `max_regions` of them starting where the last call stopped
+    /// render() resolves before every upload
+    void resolve(const ParallelFor& parallel_for = nullptr, size_t max_regions = SIZE_MAX);
+    /// Display values as of the last resolve, denoised if enabled
+    const Grid2D<RGB>& get_resolved() const {
+        return m_denoise ? m_denoised : m_final;
+    }
+    /// Averaged first hit features as of the last resolve, empty unless denoising
+    const Grid2D<Features>& get_features() const {
+        return m_features;
+    }
+
+    /// Allocates the feature buffers, tile buffers should then set `with_features`
+    /// Must come before open_checkpoint(), whose file holds the feature sums
+    void enable_features();
+    /// Denoising enables features
+    void set_denoise(bool denoise);
+    bool has_features() const {
+        return m_features.size.x > 0;
+    }
+    Denoiser& get_denoiser() {
+        return m_denoiser;
+    }
+
+    /// Mean relative standard error of pixel luminance, infinite while pixels have no samples
+    /// Safe to call while tiles are merged, the estimate then mixes old and new sums
+    Float noise();
+    /// Relative standard error of the luminance of pixel (i, j), infinite without samples
+    Float pixel_error(i32 i, i32 j);
+    /// Whether pixel (i, j) and its neighbours are all within `threshold` error
+    /// Neighbours make the test robust to a pixel whose estimate is low by chance
+    bool converged(i32 i, i32 j, Float threshold);
+
+    /// Camera samples per pixel, as counted by merged tile buffers
+    GridSpan<const u32> get_samples() const {
+        return { m_samples.data, m_samples.size };
+    }
+
+    /// Moves the accumulation grids into the file at `path`, mapped so the render
+    /// writes it directly. A file from the same scene, settings and size resumes
+    /// its samples, any other file is started over. `tiles` sizes the per tile
+    /// pass counts kept with the grids, for Renderer::start
+    /// The file is exact only as left by checkpoint() or a clean stop: a process
+    /// killed while merging a tile keeps part of that merge, which resumes repeat
+    bool open_checkpoint(const std::string& path, u64 scene_hash, size_t tiles);
+    /// Records the completed passes in the header and syncs the file, a no-op
+    /// without one. Merges must not run meanwhile, as between Renderer passes
+    void checkpoint();
+    /// Passes merged per tile, empty without a checkpoint file
+    /// Renderer::start advances the writable counts as tiles finish
+    std::span<u32> get_progress() {
+        return m_progress;
+    }
+    std::span<const u32> get_progress() const {
+        return m_progress;
+    }
+
+    /// Exposure in stops
+    void set_exposure(f32 stops) {
+        m_exposure = stops;
+    }
+    void set_tonemap(Tonemap tonemap) {
+        m_tonemap = tonemap;
+    }
 private:
+    void init_gl();
+    void mark_dirty(ivec2 begin, ivec2 end);
+    void resolve_region(size_t index);
+    void region_bounds(size_t index, ivec2& begin, ivec2& end) const;
+    void upload();
+
+    /// Byte offsets of the accumulation grids in their block, 64 byte aligned
+    struct Layout {
+        size_t tiles = 0;
+        bool features = false;
+        size_t progress, accum, sum_sq, samples, feature_sum, total;
+    };
+    Layout layout(size_t tiles, bool features, size_t begin) const;
+    /// Copies the current grids into a block of `to`, left zeroed before
+    void copy_grids(u8* base, const Layout& to) const;
+    void bind(u8* base, const Layout& layout);
+
     ivec2 size;
-    Grid2D<Float> m_weight;
-    Grid2D<Color> m_average;
+    u8* m_base = nullptr;
+    Layout m_layout;
+    /// Grids merged into, all in one block: m_storage, or the mapped checkpoint
+    GridSpan<RGBW>  m_accum;
+    GridSpan<f32>   m_sum_sq;
+    GridSpan<u32>   m_samples;
+    GridSpan<Features> m_feature_sum;
+    std::span<u32>  m_progress;
+    std::unique_ptr<u8[]> m_storage;
+    MappedFile m_checkpoint;
+
+    Grid2D<Features> m_features = Grid2D<Features>({ 0, 0 }, {});
+
+    bool m_denoise = false;
+    Denoiser m_denoiser;
+    Grid2D<RGB> m_denoised = Grid2D<RGB>({ 0, 0 }, { 0.0, 0.0, 0.0 });
+    /// Regions of the last denoised image still to be handed to upload, from the cursor on
+    size_t m_denoise_pending = 0;
+    size_t m_denoise_cursor = 0;
     Grid2D<RGB>   m_final;
 
-    GLuint m_program;
+    /// One flag per DIRTY_TILE square, set by merges and cleared by resolve
+    ivec2 m_dirty_size;
+    std::vector<u8> m_dirty;
+    size_t m_dirty_cursor = 0;
+    /// Regions converted by the last resolve, uploaded by the next render
+    std::vector<size_t> m_resolved;
+
+    f32 m_exposure = 0.0;
+    Tonemap m_tonemap = Tonemap::None;
+
+    GLuint m_program = 0;
     GLuint m_vertex_array;
     GLuint m_buffer_vertex;
     GLuint m_texture;
+
+    /// Pixel unpack buffers, alternated so writes never wait on the previous transfer
+    GLuint m_pixel_buffers[2];
+    size_t m_pixel_buffer = 0;
 };
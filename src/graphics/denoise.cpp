@@ -0,0 +1,179 @@
+#include "core.hpp"
+#include <cstring>
+
+/// exp(x) for finite x <= 0 to about 1e-4 relative error, plain arithmetic so loops over it vectorize
+/// Results below 2^-126 are flushed to about that value
+static inline f32 fast_exp(f32 x) {
+    x *= 1.44269504f;
+
+    // Truncation rather than floor, which keeps GCC from vectorizing, so f is in (-1, 0]
+    // A float clamp on x blocks vectorization as well, the exponent is clamped instead
+    i32 whole = static_cast<i32>(x);
+    f32 f = x - static_cast<f32>(whole);
+    f32 p = 1.0f + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * 0.00961813f)));
+
+    // 2^whole built directly in the exponent bits
+    i32 bits = (std::max(whole, -126) + 127) << 23;
+    f32 scale;
+    std::memcpy(&scale, &bits, sizeof(f32));
+    return p * scale;
+}
+
+void Denoiser::run(const Grid2D<RGB>& color, const Grid2D<Features>& features, Grid2D<RGB>& out, const ParallelFor& parallel_for) {
+    m_size = color.size;
+    size_t count = color.data.size();
+
+    for(size_t c = 0; c < 3; c++) {
+        m_albedo[c].resize(count);
+        m_normal[c].resize(count);
+        m_color[c].resize(count);
+        m_next[c].resize(count);
+    }
+    m_depth.resize(count);
+    m_lum.resize(count);
+
+    // Dividing by albedo leaves irradiance, smooth across texture and material edges
+    // Black albedo is clamped, those pixels divide and multiply back by the same value
+    for(size_t i = 0; i < count; i++) {
+        const Features& guide = features.data[i];
+        f32 albedo[] = {
+            std::max(static_cast<f32>(guide.albedo.r), 1e-3f),
+            std::max(static_cast<f32>(guide.albedo.g), 1e-3f),
+            std::max(static_cast<f32>(guide.albedo.b), 1e-3f)
+        };
+        f32 value[] = { color.data[i].r, color.data[i].g, color.data[i].b };
+
+        for(size_t c = 0; c < 3; c++) {
+            m_albedo[c][i] = albedo[c];
+            m_color[c][i] = value[c] / albedo[c];
+        }
+        m_normal[0][i] = guide.normal.x;
+        m_normal[1][i] = guide.normal.y;
+        m_normal[2][i] = guide.normal.z;
+        m_depth[i] = guide.depth;
+    }
+
+    for(u32 iteration = 0; iteration < iterations; iteration++) {
+        for(size_t i = 0; i < count; i++) {
+            m_lum[i] = 0.2126f * m_color[0][i] + 0.7152f * m_color[1][i] + 0.0722f * m_color[2][i];
+        }
+
+        i32 step = 1 << iteration;
+        f32 sigma = sigma_color / static_cast<f32>(step);
+        f32 inv_color = 1.0f / (sigma * sigma);
+
+        if(parallel_for) {
+            parallel_for(m_size.y, [&](size_t y) { filter_row(static_cast<i32>(y), step, inv_color); });
+        }
+        else {
+            for(i32 y = 0; y < m_size.y; y++) {
+                filter_row(y, step, inv_color);
+            }
+        }
+        for(size_t c = 0; c < 3; c++) {
+            std::swap(m_color[c], m_next[c]);
+        }
+    }
+
+    out.resize(m_size, { 0.0, 0.0, 0.0 });
+    for(size_t i = 0; i < count; i++) {
+        out.data[i] = {
+            m_color[0][i] * m_albedo[0][i],
+            m_color[1][i] * m_albedo[1][i],
+            m_color[2][i] * m_albedo[2][i]
+        };
+    }
+}
+
+void Denoiser::filter_row(i32 y, i32 step, f32 inv_color) {
+    // B3 spline taps, spread `step` pixels apart
+    constexpr f32 KERNEL[] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+    i32 width = m_size.x;
+    f32 inv_normal = 1.0f / (sigma_normal * sigma_normal);
+    f32 inv_albedo = 1.0f / (sigma_albedo * sigma_albedo);
+    f32 inv_depth = 1.0f / (sigma_depth * static_cast<f32>(step));
+
+    thread_local std::vector<f32> acc[5];
+    for(auto& row : acc) {
+        row.assign(width, 0.0f);
+    }
+    f32* weight = acc[4].data();
+    f32* sum_r = acc[0].data();
+    f32* sum_g = acc[1].data();
+    f32* sum_b = acc[2].data();
+    f32* sum_w = acc[3].data();
+
+    // Named row pointers, the compiler keeps them in registers and vectorizes over x
+    size_t p = static_cast<size_t>(y) * width;
+    const f32* lum_p = &m_lum[p];
+    const f32* depth_p = &m_depth[p];
+    const f32* nx_p = &m_normal[0][p];
+    const f32* ny_p = &m_normal[1][p];
+    const f32* nz_p = &m_normal[2][p];
+    const f32* ar_p = &m_albedo[0][p];
+    const f32* ag_p = &m_albedo[1][p];
+    const f32* ab_p = &m_albedo[2][p];
+
+    for(i32 ky = 0; ky < 5; ky++) {
+        i32 qy = y + (ky - 2) * step;
+        if(qy < 0 || qy >= m_size.y) continue;
+
+        for(i32 kx = 0; kx < 5; kx++) {
+            // Taps falling outside the frame are left out, x runs over the rest
+            i32 offset = (kx - 2) * step;
+            i32 begin = std::max(0, -offset);
+            i32 end = std::min(width, width - offset);
+            f32 h = KERNEL[kx] * KERNEL[ky];
+
+            // Offset so that index x reads the tap of pixel x
+            ptrdiff_t q = static_cast<ptrdiff_t>(qy) * width + offset;
+            const f32* lum_q = m_lum.data() + q;
+            const f32* depth_q = m_depth.data() + q;
+            const f32* nx_q = m_normal[0].data() + q;
+            const f32* ny_q = m_normal[1].data() + q;
+            const f32* nz_q = m_normal[2].data() + q;
+            const f32* ar_q = m_albedo[0].data() + q;
+            const f32* ag_q = m_albedo[1].data() + q;
+            const f32* ab_q = m_albedo[2].data() + q;
+            const f32* r_q = m_color[0].data() + q;
+            const f32* g_q = m_color[1].data() + q;
+            const f32* b_q = m_color[2].data() + q;
+
+            // Rows read here are never the ones written, which is more than GCC
+            // can prove with its limited runtime alias checks
+            #pragma GCC ivdep
+            for(i32 x = begin; x < end; x++) {
+                f32 dl = (lum_p[x] - lum_q[x]) / (lum_p[x] + lum_q[x] + 0.02f);
+
+                f32 nx = nx_p[x] - nx_q[x];
+                f32 ny = ny_p[x] - ny_q[x];
+                f32 nz = nz_p[x] - nz_q[x];
+                f32 ar = ar_p[x] - ar_q[x];
+                f32 ag = ag_p[x] - ag_q[x];
+                f32 ab = ab_p[x] - ab_q[x];
+                f32 dn = nx * nx + ny * ny + nz * nz;
+                f32 da = ar * ar + ag * ag + ab * ab;
+                f32 dz = std::abs(depth_p[x] - depth_q[x]) / (depth_p[x] + depth_q[x] + 1e-3f);
+
+                weight[x] = h * fast_exp(-(dl * dl * inv_color + dn * inv_normal + da * inv_albedo + dz * inv_depth));
+            }
+            #pragma GCC ivdep
+            for(i32 x = begin; x < end; x++) {
+                sum_r[x] += weight[x] * r_q[x];
+                sum_g[x] += weight[x] * g_q[x];
+                sum_b[x] += weight[x] * b_q[x];
+                sum_w[x] += weight[x];
+            }
+        }
+    }
+
+    // The centre tap always has weight, so the sum is never zero
+    #pragma GCC ivdep
+    for(i32 x = 0; x < width; x++) {
+        f32 scale = 1.0f / sum_w[x];
+        m_next[0][p + x] = sum_r[x] * scale;
+        m_next[1][p + x] = sum_g[x] * scale;
+        m_next[2][p + x] = sum_b[x] * scale;
+    }
+}
@@ -1,11 +1,35 @@
 #include "core.hpp"
+#include "../telemetry.hpp"
+#include <atomic>
+#include <cstring>
 
 Frame::Frame(ivec2 size)
 : size(size)
-, m_weight(size, Float(0))
-, m_average(size, Colors::BLACK) 
 , m_final(size, { 0.0, 0.0, 0.0 })
+, m_dirty_size(
+    (size.x + DIRTY_TILE - 1) / DIRTY_TILE,
+    (size.y + DIRTY_TILE - 1) / DIRTY_TILE
+)
+, m_dirty(m_dirty_size.x * m_dirty_size.y, 1)
 {
+    // Zeroed bytes are zero sums
+    Layout heap = layout(0, false, 0);
+    m_storage = std::make_unique<u8[]>(heap.total);
+    bind(m_storage.get(), heap);
+}
+Frame::~Frame() {
+    if(!m_program) return;
+
+    glDeleteBuffers(2, m_pixel_buffers);
+    glDeleteTextures(1, &m_texture);
+    
+    glDeleteBuffers(1, &m_buffer_vertex);
+    glDeleteVertexArrays(1, &m_vertex_array);
+    
+    glDeleteProgram(m_program);
+}
+
+void Frame::init_gl() {
     m_program = load_program("shaders/frame");
 
     glGenVertexArrays(1, &m_vertex_array);
@@ -31,25 +55,30 @@ Frame::Frame(ivec2 size)
     glBindTexture(GL_TEXTURE_2D, m_texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-}
-Frame::~Frame() {
-    glDeleteTextures(1, &m_texture);
-    
-    glDeleteBuffers(1, &m_buffer_vertex);
-    glDeleteVertexArrays(1, &m_vertex_array);
-    
-    glDeleteProgram(m_program);
+
+    // Immutable float storage, values above 1 reach the tonemapper
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB32F, size.x, size.y);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    size_t regions = std::min(UPLOAD_BUDGET, m_dirty.size());
+    size_t bytes = regions * DIRTY_TILE * DIRTY_TILE * sizeof(RGB);
+    glGenBuffers(2, m_pixel_buffers);
+    for(GLuint buffer : m_pixel_buffers) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
-void Frame::render() {
-    glBindTexture(GL_TEXTURE_2D, m_texture);
-    glTexImage2D(
-        GL_TEXTURE_2D, 0, GL_RGB, 
-        size.x, size.y, 0,
-        GL_RGB, GL_FLOAT, m_final.data.data()    
-    );
+void Frame::render(const ParallelFor& parallel_for) {
+    if(!m_program) init_gl();
+
+    resolve(parallel_for, UPLOAD_BUDGET);
+    upload();
 
     glUseProgram(m_program);
+    glUniform1f(0, m_exposure);
+    glUniform1i(1, static_cast<GLint>(m_tonemap));
     
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_texture);
@@ -58,29 +87,389 @@ void Frame::render() {
     glDrawArrays(GL_TRIANGLES, 0, 6);
 }
 
+void Frame::resolve(const ParallelFor& parallel_for, size_t max_regions) {
+    // Flags are cleared before reading, merges landing meanwhile mark the region again
+    // The scan resumes where the last one stopped, so a budget cannot starve regions
+    m_resolved.clear();
+    for(size_t k = 0; k < m_dirty.size() && m_resolved.size() < max_regions; k++) {
+        size_t i = (m_dirty_cursor + k) % m_dirty.size();
+        if(std::atomic_ref<u8>(m_dirty[i]).exchange(0, std::memory_order_acquire)) {
+            m_resolved.push_back(i);
+        }
+    }
+    if(!m_resolved.empty()) {
+        m_dirty_cursor = (m_resolved.back() + 1) % m_dirty.size();
+    }
 
-void Frame::add_bilinear(Vec2f uv, Color value) {
-    Float px, py;
-    Float dx = std::modf(uv.x * static_cast<Float>(size.y), &px);
-    Float dy = std::modf(uv.y * static_cast<Float>(size.y), &py);
-    
-    i32 pi = static_cast<i32>(px);
-    i32 pj = static_cast<i32>(py);
-    Float wx[] = { dx, Float(1) - dx };
-    Float wy[] = { dy, Float(1) - dy };
-
-    for(i32 j = 0; j < 2; j++) {
-        for(i32 i = 0; i < 2; i++) {
-            add_sample(pi + i, pj + j, value, wx[i] * wy[j]);
+    if(parallel_for) {
+        parallel_for(m_resolved.size(), [&](size_t i) { resolve_region(m_resolved[i]); });
+    }
+    else {
+        for(size_t index : m_resolved) {
+            resolve_region(index);
         }
     }
+
+    // The filter reaches far past the changed regions, so every region changes
+    if(m_denoise && !m_resolved.empty()) {
+        m_denoiser.run(m_final, m_features, m_denoised, parallel_for);
+        m_denoise_pending = m_dirty.size();
+    }
+
+    // Denoised regions are handed out within the budget too, the next calls
+    // continue from where this one stopped until every region has had its turn
+    if(m_denoise) {
+        size_t count = std::min(max_regions, m_denoise_pending);
+        m_resolved.resize(count);
+        for(size_t k = 0; k < count; k++) {
+            m_resolved[k] = (m_denoise_cursor + k) % m_dirty.size();
+        }
+        m_denoise_cursor = (m_denoise_cursor + count) % m_dirty.size();
+        m_denoise_pending -= count;
+    }
+}
+
+void Frame::enable_features() {
+    if(has_features()) return;
+    if(m_checkpoint.is_open()) {
+        std::cerr << "Error: Features cannot be added to an open checkpoint" << std::endl;
+        return;
+    }
+
+    // The grids move to a block with room for feature sums, keeping their samples
+    Layout heap = layout(0, true, 0);
+    auto storage = std::make_unique<u8[]>(heap.total);
+    copy_grids(storage.get(), heap);
+    m_storage = std::move(storage);
+    bind(m_storage.get(), heap);
+
+    m_features.resize(size, {});
+}
+void Frame::set_denoise(bool denoise) {
+    if(denoise) {
+        enable_features();
+        m_denoised.resize(size, { 0.0, 0.0, 0.0 });
+    }
+    m_denoise = denoise;
+    for(auto& dirty : m_dirty) {
+        dirty = 1;
+    }
+}
+
+Frame::Layout Frame::layout(size_t tiles, bool features, size_t begin) const {
+    auto align = [](size_t offset) {
+        return (offset + 63) & ~size_t(63);
+    };
+    size_t pixels = static_cast<size_t>(size.x) * size.y;
+
+    Layout out;
+    out.tiles = tiles;
+    out.features = features;
+    out.progress = align(begin);
+    out.accum = align(out.progress + tiles * sizeof(u32));
+    out.sum_sq = align(out.accum + pixels * sizeof(RGBW));
+    out.samples = align(out.sum_sq + pixels * sizeof(f32));
+    out.feature_sum = align(out.samples + pixels * sizeof(u32));
+    out.total = out.feature_sum + (features ? pixels * sizeof(Features) : 0);
+    return out;
+}
+
+void Frame::copy_grids(u8* base, const Layout& to) const {
+    auto copy = [&](const auto& grid, size_t offset) {
+        std::memcpy(base + offset, grid.data.data(), grid.data.size_bytes());
+    };
+    copy(m_accum, to.accum);
+    copy(m_sum_sq, to.sum_sq);
+    copy(m_samples, to.samples);
+    if(to.features) copy(m_feature_sum, to.feature_sum);
+}
+
+void Frame::bind(u8* base, const Layout& layout) {
+    size_t pixels = static_cast<size_t>(size.x) * size.y;
+    m_base = base;
+    m_layout = layout;
+    m_progress = { reinterpret_cast<u32*>(base + layout.progress), layout.tiles };
+    m_accum = { { reinterpret_cast<RGBW*>(base + layout.accum), pixels }, size };
+    m_sum_sq = { { reinterpret_cast<f32*>(base + layout.sum_sq), pixels }, size };
+    m_samples = { { reinterpret_cast<u32*>(base + layout.samples), pixels }, size };
+    m_feature_sum = {};
+    if(layout.features) {
+        m_feature_sum = { { reinterpret_cast<Features*>(base + layout.feature_sum), pixels }, size };
+    }
+}
+
+void Frame::region_bounds(size_t index, ivec2& begin, ivec2& end) const {
+    begin = {
+        static_cast<i32>(index % m_dirty_size.x) * DIRTY_TILE,
+        static_cast<i32>(index / m_dirty_size.x) * DIRTY_TILE
+    };
+    end = { std::min(begin.x + DIRTY_TILE, size.x), std::min(begin.y + DIRTY_TILE, size.y) };
+}
+
+void Frame::resolve_region(size_t index) {
+    ivec2 begin, end;
+    region_bounds(index, begin, end);
+    i32 x0 = begin.x;
+    i32 count = end.x - begin.x;
+
+    for(i32 y = begin.y; y < end.y; y++) {
+        // Atomic loads into a row buffer, workers may be merging into it
+        f32 weight[DIRTY_TILE];
+        f32 sum[3][DIRTY_TILE];
+        for(i32 i = 0; i < count; i++) {
+            RGBW& value = m_accum.get(x0 + i, y);
+            weight[i] = std::atomic_ref<f32>(value.w).load(std::memory_order_relaxed);
+            sum[0][i] = std::atomic_ref<f32>(value.r).load(std::memory_order_relaxed);
+            sum[1][i] = std::atomic_ref<f32>(value.g).load(std::memory_order_relaxed);
+            sum[2][i] = std::atomic_ref<f32>(value.b).load(std::memory_order_relaxed);
+        }
+
+        // Plain loop over the row, vectorized by the compiler
+        RGB* out = &m_final.get(x0, y);
+        for(i32 i = 0; i < count; i++) {
+            f32 scale = (weight[i] > 0.0f) ? 1.0f / weight[i] : 0.0f;
+            out[i] = { sum[0][i] * scale, sum[1][i] * scale, sum[2][i] * scale };
+        }
+
+        if(!has_features()) continue;
+        auto load = [](Float& value) {
+            return std::atomic_ref<Float>(value).load(std::memory_order_relaxed);
+        };
+        for(i32 i = 0; i < count; i++) {
+            Float scale = (weight[i] > 0.0f) ? 1.0 / weight[i] : 0.0;
+            Features& sum = m_feature_sum.get(x0 + i, y);
+            m_features.get(x0 + i, y) = {
+                scale * Color { load(sum.albedo.r), load(sum.albedo.g), load(sum.albedo.b) },
+                scale * Vec3f { load(sum.normal.x), load(sum.normal.y), load(sum.normal.z) },
+                scale * load(sum.depth)
+            };
+        }
+    }
+}
+
+void Frame::upload() {
+    if(m_resolved.empty()) return;
+
+    m_pixel_buffer ^= 1;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixel_buffers[m_pixel_buffer]);
+
+    size_t bytes = m_resolved.size() * DIRTY_TILE * DIRTY_TILE * sizeof(RGB);
+    auto* staging = static_cast<u8*>(glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER, 0, bytes, 
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT
+    ));
+
+    // Regions are packed one after another, rows tightly
+    std::vector<size_t> offsets;
+    size_t offset = 0;
+    if(staging) {
+        for(size_t index : m_resolved) {
+            ivec2 begin, end;
+            region_bounds(index, begin, end);
+
+            offsets.push_back(offset);
+            size_t row = (end.x - begin.x) * sizeof(RGB);
+            for(i32 y = begin.y; y < end.y; y++) {
+                std::memcpy(staging + offset, &get_resolved().get(begin.x, y), row);
+                offset += row;
+            }
+        }
+    }
+
+    // A failed map or a lost buffer leaves the regions dirty for the next frame
+    if(!staging || glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        for(size_t index : m_resolved) {
+            std::atomic_ref<u8>(m_dirty[index]).store(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    for(size_t k = 0; k < m_resolved.size(); k++) {
+        ivec2 begin, end;
+        region_bounds(m_resolved[k], begin, end);
+        glTexSubImage2D(
+            GL_TEXTURE_2D, 0, begin.x, begin.y,
+            end.x - begin.x, end.y - begin.y,
+            GL_RGB, GL_FLOAT, reinterpret_cast<const void*>(offsets[k])
+        );
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+Float Frame::noise() {
+    Float total = 0.0;
+    for(i32 j = 0; j < size.y; j++) {
+        for(i32 i = 0; i < size.x; i++) {
+            total += pixel_error(i, j);
+        }
+    }
+    return total / (size.x * size.y);
+}
+
+Float Frame::pixel_error(i32 i, i32 j) {
+    RGBW& sum = m_accum.get(i, j);
+    Float weight = std::atomic_ref<f32>(sum.w).load(std::memory_order_relaxed);
+    if(weight <= 0.0) return INFINITY;
+
+    Float mean = luminance({
+        std::atomic_ref<f32>(sum.r).load(std::memory_order_relaxed),
+        std::atomic_ref<f32>(sum.g).load(std::memory_order_relaxed),
+        std::atomic_ref<f32>(sum.b).load(std::memory_order_relaxed)
+    }) / weight;
+    Float mean_sq = std::atomic_ref<f32>(m_sum_sq.get(i, j)).load(std::memory_order_relaxed) / weight;
+
+    // Splat weights of a pass add up to about one per pixel, so the weight
+    // stands in for the sample count. The offset keeps dark pixels from dominating
+    Float variance = std::max(0.0, mean_sq - mean * mean);
+    return std::sqrt(variance / weight) / (mean + 0.01);
+}
+
+bool Frame::converged(i32 i, i32 j, Float threshold) {
+    for(i32 y = std::max(0, j - 1); y <= std::min(size.y - 1, j + 1); y++) {
+        for(i32 x = std::max(0, i - 1); x <= std::min(size.x - 1, i + 1); x++) {
+            if(!(pixel_error(x, y) <= threshold)) return false;
+        }
+    }
+    return true;
+}
+
+void Frame::mark_dirty(ivec2 begin, ivec2 end) {
+    i32 x0 = std::max(0, begin.x) / DIRTY_TILE;
+    i32 y0 = std::max(0, begin.y) / DIRTY_TILE;
+    i32 x1 = std::min(end.x, size.x);
+    i32 y1 = std::min(end.y, size.y);
+
+    for(i32 y = y0; y * DIRTY_TILE < y1; y++) {
+        for(i32 x = x0; x * DIRTY_TILE < x1; x++) {
+            std::atomic_ref<u8>(m_dirty[x + m_dirty_size.x * y]).store(1, std::memory_order_release);
+        }
+    }
+}
+
+void Frame::add_bilinear(Vec2f uv, Color value) {
+    telemetry::count(telemetry::Splats);
+    splat_bilinear(uv, size, [&](i32 i, i32 j, Float weight) {
+        add_sample(i, j, value, weight);
+    });
 }
 void Frame::add_sample(i32 i, i32 j, Color value, Float weight) {
     if(0 <= i && i < size.x && 0 <= j && j < size.y) {
-        Float W = m_weight.get(i, j);
+        Float lum = luminance(value);
+        RGBW& sum = m_accum.get(i, j);
+        sum.r += weight * value.r;
+        sum.g += weight * value.g;
+        sum.b += weight * value.b;
+        sum.w += weight;
+        m_sum_sq.get(i, j) += weight * lum * lum;
+        mark_dirty({ i, j }, { i + 1, j + 1 });
+    }
+}
+
+void Frame::merge(const TileBuffer& tile) {
+    for(i32 j = 0; j < tile.weight.size.y; j++) {
+        for(i32 i = 0; i < tile.weight.size.x; i++) {
+            i32 x = tile.begin.x + i;
+            i32 y = tile.begin.y + j;
+            if(x < 0 || x >= size.x || y < 0 || y >= size.y) continue;
+
+            Float weight = tile.weight.get(i, j);
+            if(weight == 0.0) continue;
+
+            // The tile's f64 sums are rounded once here, per pass
+            const Color& value = tile.sum.get(i, j);
+            RGBW& sum = m_accum.get(x, y);
+            std::atomic_ref<f32>(sum.r).fetch_add(value.r, std::memory_order_relaxed);
+            std::atomic_ref<f32>(sum.g).fetch_add(value.g, std::memory_order_relaxed);
+            std::atomic_ref<f32>(sum.b).fetch_add(value.b, std::memory_order_relaxed);
+            std::atomic_ref<f32>(sum.w).fetch_add(weight, std::memory_order_relaxed);
+            std::atomic_ref<f32>(m_sum_sq.get(x, y)).fetch_add(tile.sum_sq.get(i, j), std::memory_order_relaxed);
+            std::atomic_ref<u32>(m_samples.get(x, y)).fetch_add(tile.samples.get(i, j), std::memory_order_relaxed);
+
+            if(!tile.with_features || !has_features()) continue;
+            const Features& features = tile.features.get(i, j);
+            Features& target = m_feature_sum.get(x, y);
+            std::atomic_ref<Float>(target.albedo.r).fetch_add(features.albedo.r, std::memory_order_relaxed);
+            std::atomic_ref<Float>(target.albedo.g).fetch_add(features.albedo.g, std::memory_order_relaxed);
+            std::atomic_ref<Float>(target.albedo.b).fetch_add(features.albedo.b, std::memory_order_relaxed);
+            std::atomic_ref<Float>(target.normal.x).fetch_add(features.normal.x, std::memory_order_relaxed);
+            std::atomic_ref<Float>(target.normal.y).fetch_add(features.normal.y, std::memory_order_relaxed);
+            std::atomic_ref<Float>(target.normal.z).fetch_add(features.normal.z, std::memory_order_relaxed);
+            std::atomic_ref<Float>(target.depth).fetch_add(features.depth, std::memory_order_relaxed);
+        }
+    }
+
+    // After the adds, so a resolve that sees the flag also sees the sums
+    mark_dirty(tile.begin, { tile.begin.x + tile.weight.size.x, tile.begin.y + tile.weight.size.y });
+}
 
-        m_weight.get(i, j) += weight;
-        m_average.get(i, j) += weight * (value - m_average.get(i, j)) / (W + weight);
-        m_final.get(i, j) = RGB::from(m_average.get(i, j));
+void Frame::merge(const Frame& other) {
+    for(size_t i = 0; i < m_accum.data.size(); i++) {
+        const RGBW& value = other.m_accum.data[i];
+        RGBW& sum = m_accum.data[i];
+        sum.r += value.r;
+        sum.g += value.g;
+        sum.b += value.b;
+        sum.w += value.w;
+        m_sum_sq.data[i] += other.m_sum_sq.data[i];
+        m_samples.data[i] += other.m_samples.data[i];
+    }
+    if(has_features() && other.has_features()) {
+        for(size_t i = 0; i < m_feature_sum.data.size(); i++) {
+            const Features& value = other.m_feature_sum.data[i];
+            Features& sum = m_feature_sum.data[i];
+            sum.albedo += value.albedo;
+            sum.normal += value.normal;
+            sum.depth += value.depth;
+        }
+    }
+    for(auto& dirty : m_dirty) {
+        dirty = 1;
     }
 }
+
+void TileBuffer::reset(ivec2 tile_begin, ivec2 tile_end) {
+    begin = { tile_begin.x - 1, tile_begin.y - 1 };
+    ivec2 size = { tile_end.x - tile_begin.x + 2, tile_end.y - tile_begin.y + 2 };
+    weight.resize(size, 0.0);
+    sum.resize(size, Colors::BLACK);
+    sum_sq.resize(size, 0.0);
+    samples.resize(size, 0);
+    if(with_features) features.resize(size, {});
+}
+void TileBuffer::add_sample(i32 i, i32 j, Color value, Float w) {
+    i -= begin.x;
+    j -= begin.y;
+    if(0 <= i && i < weight.size.x && 0 <= j && j < weight.size.y) {
+        Float lum = luminance(value);
+        weight.get(i, j) += w;
+        sum.get(i, j) += w * value;
+        sum_sq.get(i, j) += w * lum * lum;
+    }
+}
+void TileBuffer::count_sample(i32 i, i32 j) {
+    i -= begin.x;
+    j -= begin.y;
+    if(0 <= i && i < samples.size.x && 0 <= j && j < samples.size.y) {
+        samples.get(i, j)++;
+    }
+}
+void TileBuffer::add_features(Vec2f uv, ivec2 frame_size, const Features& value) {
+    splat_bilinear(uv, frame_size, [&](i32 i, i32 j, Float w) {
+        i -= begin.x;
+        j -= begin.y;
+        if(0 <= i && i < features.size.x && 0 <= j && j < features.size.y) {
+            Features& sum = features.get(i, j);
+            sum.albedo += w * value.albedo;
+            sum.normal += w * value.normal;
+            sum.depth += w * value.depth;
+        }
+    });
+}
+void TileBuffer::add_bilinear(Vec2f uv, ivec2 frame_size, Color value) {
+    telemetry::count(telemetry::Splats);
+    splat_bilinear(uv, frame_size, [&](i32 i, i32 j, Float w) {
+        add_sample(i, j, value, w);
+    });
+}
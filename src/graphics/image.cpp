@@ -0,0 +1,345 @@
+#include "core.hpp"
+#include <array>
+#include <bit>
+#include <cstring>
+
+static f32 srgb_encode(f32 linear) {
+    linear = std::max(linear, 0.0f);
+    return (linear < 0.0031308f)
+        ? 12.92f * linear
+        : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+}
+static f32 aces(f32 x) {
+    return std::clamp((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f, 1.0f);
+}
+
+RGB display_transform(RGB linear, f32 exposure, Tonemap tonemap) {
+    f32 scale = std::exp2(exposure);
+    f32 channels[] = { linear.r * scale, linear.g * scale, linear.b * scale };
+
+    for(f32& c : channels) {
+        if(tonemap == Tonemap::Reinhard) c = srgb_encode(c / (1.0f + c));
+        if(tonemap == Tonemap::ACES) c = srgb_encode(aces(c));
+    }
+    return { channels[0], channels[1], channels[2] };
+}
+
+
+
+template<typename T>
+static void write_le(std::ostream& out, T value) {
+    static_assert(std::endian::native == std::endian::little);
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+static void write_be32(std::ostream& out, u32 value) {
+    char bytes[] = {
+        static_cast<char>(value >> 24), static_cast<char>(value >> 16),
+        static_cast<char>(value >> 8),  static_cast<char>(value)
+    };
+    out.write(bytes, 4);
+}
+
+static bool open_output(std::ofstream& file, const std::string& path) {
+    file.open(path, std::ios::binary);
+    if(!file.is_open()) {
+        std::cerr << "Error: Cannot write file [" << path << "]" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool save_pfm(const std::string& path, const Grid2D<RGB>& image) {
+    std::ofstream file;
+    if(!open_output(file, path)) return false;
+
+    // Negative scale marks little endian data, rows run bottom to top as in the frame
+    file << "PF\n" << image.size.x << " " << image.size.y << "\n-1.0\n";
+    file.write(reinterpret_cast<const char*>(image.data.data()), image.data.size() * sizeof(RGB));
+    return file.good();
+}
+
+/// Header attributes, tiled files set `tile_size` and list tiles in any order
+/// The data window may be larger than the displayed `size`
+static void write_exr_header(std::ostream& file, ivec2 data_min, ivec2 data_max, ivec2 size, i32 tile_size = 0) {
+    auto attribute = [&](const char* name, const char* type, i32 bytes) {
+        file.write(name, std::strlen(name) + 1);
+        file.write(type, std::strlen(type) + 1);
+        write_le<i32>(file, bytes);
+    };
+    auto box = [&](const char* name, ivec2 min, ivec2 max) {
+        attribute(name, "box2i", 16);
+        write_le<i32>(file, min.x);
+        write_le<i32>(file, min.y);
+        write_le<i32>(file, max.x);
+        write_le<i32>(file, max.y);
+    };
+
+    write_le<u32>(file, 20000630);
+    write_le<u32>(file, tile_size > 0 ? 2 | 0x200 : 2);
+
+    // Channels are listed in alphabetical order, all 32 bit float
+    attribute("channels", "chlist", 3 * 18 + 1);
+    for(const char* name : { "B", "G", "R" }) {
+        file.write(name, 2);
+        write_le<i32>(file, 2);
+        write_le<u32>(file, 0);
+        write_le<i32>(file, 1);
+        write_le<i32>(file, 1);
+    }
+    file.put(0);
+
+    attribute("compression", "compression", 1);
+    file.put(0);
+    box("dataWindow", data_min, data_max);
+    box("displayWindow", { 0, 0 }, { size.x - 1, size.y - 1 });
+    attribute("lineOrder", "lineOrder", 1);
+    file.put(tile_size > 0 ? 2 : 0);
+    attribute("pixelAspectRatio", "float", 4);
+    write_le<f32>(file, 1.0f);
+    attribute("screenWindowCenter", "v2f", 8);
+    write_le<f32>(file, 0.0f);
+    write_le<f32>(file, 0.0f);
+    attribute("screenWindowWidth", "float", 4);
+    write_le<f32>(file, 1.0f);
+    if(tile_size > 0) {
+        // One level, no mipmaps
+        attribute("tiles", "tiledesc", 9);
+        write_le<u32>(file, tile_size);
+        write_le<u32>(file, tile_size);
+        file.put(0);
+    }
+    file.put(0);
+}
+
+bool save_exr(const std::string& path, const Grid2D<RGB>& image) {
+    std::ofstream file;
+    if(!open_output(file, path)) return false;
+    write_exr_header(file, { 0, 0 }, { image.size.x - 1, image.size.y - 1 }, image.size);
+
+    // One chunk per scanline, top first: line number, byte count, then each channel's row
+    u64 row_bytes = 3 * sizeof(f32) * image.size.x;
+    u64 offset = static_cast<u64>(file.tellp()) + sizeof(u64) * image.size.y;
+    for(i32 y = 0; y < image.size.y; y++) {
+        write_le<u64>(file, offset + y * (8 + row_bytes));
+    }
+
+    std::vector<f32> row(3 * image.size.x);
+    for(i32 y = 0; y < image.size.y; y++) {
+        const RGB* pixels = &image.get(0, image.size.y - 1 - y);
+        for(i32 x = 0; x < image.size.x; x++) {
+            row[x] = pixels[x].b;
+            row[x + image.size.x] = pixels[x].g;
+            row[x + 2 * image.size.x] = pixels[x].r;
+        }
+        write_le<i32>(file, y);
+        write_le<i32>(file, row_bytes);
+        file.write(reinterpret_cast<const char*>(row.data()), row_bytes);
+    }
+    return file.good();
+}
+
+bool TiledExrWriter::open(const std::string& path, ivec2 size, i32 tile_size) {
+    if(!open_output(m_file, path)) return false;
+    m_size = size;
+    m_tile = tile_size;
+    m_tiles = { (size.x + tile_size - 1) / tile_size, (size.y + tile_size - 1) / tile_size };
+    m_top = size.y - m_tiles.y * tile_size;
+    m_written.assign(m_tiles.x * m_tiles.y, false);
+
+    write_exr_header(m_file, { 0, m_top }, { size.x - 1, size.y - 1 }, size, tile_size);
+
+    // Offsets are filled in as tiles arrive
+    m_table = m_file.tellp();
+    for(size_t i = 0; i < m_written.size(); i++) {
+        write_le<u64>(m_file, 0);
+    }
+    return m_file.good();
+}
+
+bool TiledExrWriter::write_tile(ivec2 begin, const Grid2D<RGB>& pixels) {
+    // Frame tile rows count up from the bottom, EXR tile rows down from the top
+    i32 tx = begin.x / m_tile;
+    i32 ty = m_tiles.y - 1 - begin.y / m_tile;
+    i32 width = pixels.size.x;
+    i32 top = m_top + ty * m_tile;
+    i32 height = std::min(m_tile, m_size.y - top);
+
+    // A line of the tile per channel, rows above the image are black
+    std::vector<f32> data(3 * width * height, 0.0f);
+    for(i32 y = 0; y < height; y++) {
+        i32 j = m_size.y - 1 - (top + y) - begin.y;
+        if(j < 0 || j >= pixels.size.y) continue;
+
+        f32* line = &data[3 * width * y];
+        for(i32 x = 0; x < width; x++) {
+            const RGB& pixel = pixels.get(x, j);
+            line[x] = pixel.b;
+            line[x + width] = pixel.g;
+            line[x + 2 * width] = pixel.r;
+        }
+    }
+
+    std::lock_guard lock(m_mutex);
+    return write_chunk(tx, ty, data);
+}
+
+bool TiledExrWriter::write_chunk(i32 tx, i32 ty, const std::vector<f32>& data) {
+    size_t index = tx + m_tiles.x * ty;
+    m_file.seekp(0, std::ios::end);
+    u64 offset = m_file.tellp();
+
+    write_le<i32>(m_file, tx);
+    write_le<i32>(m_file, ty);
+    write_le<i32>(m_file, 0);
+    write_le<i32>(m_file, 0);
+    write_le<i32>(m_file, data.size() * sizeof(f32));
+    m_file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(f32));
+
+    m_file.seekp(m_table + index * sizeof(u64));
+    write_le<u64>(m_file, offset);
+    m_written[index] = true;
+    return m_file.good();
+}
+
+bool TiledExrWriter::close() {
+    if(!m_file.is_open()) return false;
+
+    // Readers need every tile, those never rendered are written black
+    for(i32 ty = 0; ty < m_tiles.y; ty++) {
+        for(i32 tx = 0; tx < m_tiles.x; tx++) {
+            if(m_written[tx + m_tiles.x * ty]) continue;
+            i32 width = std::min(m_tile, m_size.x - tx * m_tile);
+            i32 height = std::min(m_tile, m_size.y - (m_top + ty * m_tile));
+            write_chunk(tx, ty, std::vector<f32>(3 * width * height, 0.0f));
+        }
+    }
+    bool good = m_file.good();
+    m_file.close();
+    return good;
+}
+
+static u32 crc32(const u8* data, size_t size, u32 crc = 0) {
+    static const std::array<u32, 256> table = [] {
+        std::array<u32, 256> table;
+        for(u32 n = 0; n < 256; n++) {
+            u32 c = n;
+            for(int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        return table;
+    }();
+
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+bool save_png(const std::string& path, const Grid2D<RGB>& image, f32 exposure, Tonemap tonemap) {
+    std::ofstream file;
+    if(!open_output(file, path)) return false;
+
+    auto chunk = [&](const char* type, const std::vector<u8>& data) {
+        write_be32(file, data.size());
+        file.write(type, 4);
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+        u32 crc = crc32(reinterpret_cast<const u8*>(type), 4);
+        write_be32(file, crc32(data.data(), data.size(), crc));
+    };
+    auto push_be32 = [](std::vector<u8>& data, u32 value) {
+        for(int shift = 24; shift >= 0; shift -= 8) {
+            data.push_back(static_cast<u8>(value >> shift));
+        }
+    };
+
+    // Scanlines top first, each behind a zero filter byte
+    std::vector<u8> raw;
+    raw.reserve((3 * image.size.x + 1) * image.size.y);
+    for(i32 y = image.size.y - 1; y >= 0; y--) {
+        raw.push_back(0);
+        for(i32 x = 0; x < image.size.x; x++) {
+            RGB color = display_transform(image.get(x, y), exposure, tonemap);
+            for(f32 c : { color.r, color.g, color.b }) {
+                raw.push_back(static_cast<u8>(std::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f));
+            }
+        }
+    }
+
+    // zlib stream of stored deflate blocks, then the Adler-32 of the raw bytes
+    std::vector<u8> zlib = { 0x78, 0x01 };
+    for(size_t begin = 0; begin < raw.size() || begin == 0; begin += 0xFFFF) {
+        size_t count = std::min<size_t>(0xFFFF, raw.size() - begin);
+        zlib.push_back(begin + count >= raw.size() ? 1 : 0);
+        zlib.push_back(count & 0xFF);
+        zlib.push_back(count >> 8);
+        zlib.push_back(~count & 0xFF);
+        zlib.push_back((~count >> 8) & 0xFF);
+        zlib.insert(zlib.end(), raw.begin() + begin, raw.begin() + begin + count);
+    }
+    u32 a = 1, b = 0;
+    for(u8 byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    push_be32(zlib, (b << 16) | a);
+
+    std::vector<u8> header;
+    push_be32(header, image.size.x);
+    push_be32(header, image.size.y);
+    header.insert(header.end(), { 8, 2, 0, 0, 0 });
+
+    const u8 signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    file.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    chunk("IHDR", header);
+    chunk("IDAT", zlib);
+    chunk("IEND", {});
+    return file.good();
+}
+
+bool save_image(const std::string& path, const Grid2D<RGB>& image, f32 exposure, Tonemap tonemap) {
+    auto ends_with = [&](const std::string& suffix) {
+        return path.size() >= suffix.size()
+            && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+    if(ends_with(".pfm")) return save_pfm(path, image);
+    if(ends_with(".exr")) return save_exr(path, image);
+    if(ends_with(".png")) return save_png(path, image, exposure, tonemap);
+
+    std::cerr << "Error: Unknown image format [" << path << "]" << std::endl;
+    return false;
+}
+
+Grid2D<RGB> sample_heatmap(GridSpan<const u32> samples) {
+    const RGB ramp[] = {
+        { 0.05f, 0.05f, 0.40f },
+        { 0.10f, 0.50f, 0.90f },
+        { 0.20f, 0.80f, 0.30f },
+        { 0.95f, 0.85f, 0.10f },
+        { 0.90f, 0.15f, 0.10f }
+    };
+    constexpr size_t STEPS = sizeof(ramp) / sizeof(RGB) - 1;
+
+    u32 max = 1;
+    for(u32 count : samples.data) {
+        max = std::max(max, count);
+    }
+
+    Grid2D<RGB> image(samples.size, { 0.0, 0.0, 0.0 });
+    for(size_t i = 0; i < samples.data.size(); i++) {
+        f32 t = static_cast<f32>(samples.data[i]) / max * STEPS;
+        size_t k = std::min(static_cast<size_t>(t), STEPS - 1);
+        f32 f = t - k;
+
+        image.data[i] = {
+            ramp[k].r + f * (ramp[k + 1].r - ramp[k].r),
+            ramp[k].g + f * (ramp[k + 1].g - ramp[k].g),
+            ramp[k].b + f * (ramp[k + 1].b - ramp[k].b)
+        };
+    }
+    return image;
+}
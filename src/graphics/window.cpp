@@ -86,6 +86,10 @@ void Window::update() {
     glfwPollEvents();
 }
 
+void Window::set_title(const std::string& title) {
+    glfwSetWindowTitle(handle, title.c_str());
+}
+
 dvec2 Window::get_mouse_pos() {
     f64 px, py;
     i32 width, height;
@@ -3,116 +3,577 @@
 
 #include "core.hpp"
 #include "shapes/core.hpp"
+#include "render/core.hpp"
 
 
 
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <fstream>
+#include <optional>
 #include <random>
 #include <thread>
 
 
 
 
+/// Set by SIGINT and SIGTERM, the render then stops like a met budget,
+/// finishing the tiles it started and checkpointing
+static volatile std::sig_atomic_t s_stop = 0;
+static void request_stop(int signal) {
+    s_stop = 1;
+    // A second signal ends the process as usual
+    std::signal(signal, SIG_DFL);
+}
+
 int main(int argc, char **argv) {
+    // --wavefront: breadth first integrator instead of Integrator::pathtrace
+    // --min-depth N, --max-depth N: Russian roulette starts after N bounces,
+    // min-depth >= max-depth disables it
+    // --sampler random|sobol|bluenoise: source of camera and bounce samples
+    // --threads N, --passes N, --tile N: render scheduling, 0 threads uses every
+    // hardware thread, 0 passes renders until the window closes
+    // --exposure STOPS, --tonemap none|reinhard|aces: display transform, headless renders
+    // default to reinhard so their PNGs are sRGB encoded, the window to none
+    // --headless: no window, render until a budget is met and save the image
+    // --spp N, --time SECONDS, --noise ERROR: budgets, the first one met ends the
+    // render, a headless render without any stops at 64 spp. --spp is --passes, one
+    // sample per pixel each
+    // --output PATH: image written after a headless render, .pfm, .exr or .png,
+    // may be repeated
+    // --adaptive ERROR: after ADAPTIVE_MIN_PASSES, skip pixels whose neighbourhood is within
+    // the relative error, --heatmap PATH: image of the samples each pixel took
+    // --denoise: A-trous filter guided by first hit albedo, normal and depth, as a resolve stage
+    // --aovs PREFIX: write those features as PREFIX.albedo.pfm, .normal.pfm and .depth.pfm
+    // --checkpoint PATH: accumulate in a mapped file, resumed by a later run with the same
+    // scene and settings, --checkpoint-every SECONDS: how often it is synced to disk
+    // --width N, --height N: frame size
+    // --tiled PATH: headless render tile by tile, streaming finished tiles to a tiled .exr
+    // so the frame is never held in memory, the frame wide options above and --time do not apply
+    // --serve ADDRESS --workers N: render farm coordinator, splits the passes between N
+    // workers, merges their sums and saves the outputs. --connect ADDRESS: farm worker,
+    // rendering its share with the same scene and settings. Addresses are host:port for
+    // TCP or a Unix socket path. --adaptive and --noise do not apply to either
+    // --telemetry SECONDS: print the hot path counters as a JSON line this often, and show
+    // ray rates in the window title, needs a build configured with -Dtelemetry=true
+    constexpr u32 ADAPTIVE_MIN_PASSES = 8;
+    bool wavefront = false;
+    bool headless = false;
+    Float time_budget = 0.0;
+    Float noise_budget = 0.0;
+    std::vector<std::string> outputs;
+    Float adaptive = 0.0;
+    std::string heatmap;
+    bool denoise = false;
+    std::string aovs;
+    std::string checkpoint;
+    Float checkpoint_every = 60.0;
+    i32 width = 512;
+    i32 height = 512;
+    std::string tiled;
+    std::string serve;
+    u32 farm_workers = 1;
+    std::string connect;
+    Float telemetry_every = 0.0;
+    f32 exposure = 0.0;
+    std::optional<Tonemap> tonemap;
+    RenderOptions render_options;
+    std::string sampler_name = "sobol";
+    size_t min_depth = 3;
+    size_t max_depth = 10;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--wavefront") wavefront = true;
+        if(arg == "--min-depth" && i + 1 < argc) min_depth = std::stoul(argv[++i]);
+        if(arg == "--max-depth" && i + 1 < argc) max_depth = std::stoul(argv[++i]);
+        if(arg == "--sampler" && i + 1 < argc) sampler_name = argv[++i];
+        if(arg == "--threads" && i + 1 < argc) render_options.threads = std::stoul(argv[++i]);
+        if(arg == "--passes" && i + 1 < argc) render_options.passes = std::stoul(argv[++i]);
+        if(arg == "--spp" && i + 1 < argc) render_options.passes = std::stoul(argv[++i]);
+        if(arg == "--headless") headless = true;
+        if(arg == "--time" && i + 1 < argc) time_budget = std::stod(argv[++i]);
+        if(arg == "--noise" && i + 1 < argc) noise_budget = std::stod(argv[++i]);
+        if(arg == "--output" && i + 1 < argc) outputs.push_back(argv[++i]);
+        if(arg == "--adaptive" && i + 1 < argc) adaptive = std::stod(argv[++i]);
+        if(arg == "--heatmap" && i + 1 < argc) heatmap = argv[++i];
+        if(arg == "--denoise") denoise = true;
+        if(arg == "--aovs" && i + 1 < argc) aovs = argv[++i];
+        if(arg == "--checkpoint" && i + 1 < argc) checkpoint = argv[++i];
+        if(arg == "--checkpoint-every" && i + 1 < argc) checkpoint_every = std::stod(argv[++i]);
+        if(arg == "--width" && i + 1 < argc) width = std::stoi(argv[++i]);
+        if(arg == "--height" && i + 1 < argc) height = std::stoi(argv[++i]);
+        if(arg == "--tiled" && i + 1 < argc) tiled = argv[++i];
+        if(arg == "--serve" && i + 1 < argc) serve = argv[++i];
+        if(arg == "--workers" && i + 1 < argc) farm_workers = std::max(1ul, std::stoul(argv[++i]));
+        if(arg == "--connect" && i + 1 < argc) connect = argv[++i];
+        if(arg == "--telemetry" && i + 1 < argc) telemetry_every = std::stod(argv[++i]);
+        if(arg == "--tile" && i + 1 < argc) render_options.tile_size = std::stoi(argv[++i]);
+        if(arg == "--exposure" && i + 1 < argc) exposure = std::stof(argv[++i]);
+        if(arg == "--tonemap" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if(name == "none") tonemap = Tonemap::None;
+            if(name == "reinhard") tonemap = Tonemap::Reinhard;
+            if(name == "aces") tonemap = Tonemap::ACES;
+        }
+    }
+    if(telemetry_every > 0.0 && !telemetry::ENABLED) {
+        std::cerr << "Error: Telemetry is compiled out, configure with -Dtelemetry=true" << std::endl;
+        telemetry_every = 0.0;
+    }
+    if(!tiled.empty() && (!serve.empty() || !connect.empty())) {
+        std::cerr << "Error: Render farms merge frames, --tiled renders have none" << std::endl;
+        return 1;
+    }
+    if(!serve.empty() || !connect.empty()) {
+        // Each worker only sees its share of the samples, so none can judge convergence
+        if(adaptive > 0.0 || noise_budget > 0.0) {
+            std::cerr << "Error: Farm workers hold part of the frame, ignoring --adaptive and --noise" << std::endl;
+        }
+        headless = true;
+        adaptive = 0.0;
+        noise_budget = 0.0;
+    }
+    // The coordinator hands out passes, so it needs a fixed count
+    if(!serve.empty() && render_options.passes == 0) {
+        render_options.passes = 64;
+    }
+    if(!tiled.empty()) {
+        if(adaptive > 0.0 || noise_budget > 0.0 || denoise || !aovs.empty() || !heatmap.empty() || !checkpoint.empty()) {
+            std::cerr << "Error: --tiled renders hold no frame, ignoring "
+                << "--adaptive, --noise, --denoise, --aovs, --heatmap and --checkpoint" << std::endl;
+        }
+        // Tiles are written once all their passes are in, a cut off tile would stay black
+        if(time_budget > 0.0) {
+            std::cerr << "Error: --tiled renders write whole tiles only, ignoring --time" << std::endl;
+        }
+        headless = true;
+        adaptive = 0.0;
+        noise_budget = 0.0;
+        time_budget = 0.0;
+        render_options.tile_major = true;
+        if(render_options.passes == 0) render_options.passes = 64;
+    }
+    if(headless) {
+        if(render_options.passes == 0 && time_budget <= 0.0 && noise_budget <= 0.0) {
+            render_options.passes = 64;
+        }
+        if(outputs.empty()) outputs = { "render.exr", "render.png" };
+        if(!tonemap) tonemap = Tonemap::Reinhard;
+    }
 
-    ShapeList scene;
-
-    scene.add(
-        Sphere {}
-            .with_pos({ -0.3, -0.6, 0.50 })
-            .with_radius(0.4)
-            .with_material({ .diffuse = 0.7 * Colors::WHITE })
-            .build()
-    );
-
-    std::pair<Vec3f, Material> planes[] = {
-        { {-1.0, 0.0, 0.0 }, Material { .diffuse = 0.95 * Colors::RED   } },
-        { {+1.0, 0.0, 0.0 }, Material { .diffuse = 0.95 * Colors::GREEN } },
-        { { 0.0,-1.0, 0.0 }, Material { .diffuse = 0.95 * Colors::WHITE } },
-        { { 0.0,+1.0, 0.0 }, Material { .diffuse = 0.95 * Colors::WHITE } },
-        { 
-            { 0.0, 0.0,-1.0 }, 
-            Material { 
-                .diffuse = 0.7 * Colors::WHITE,
-                .specular = 0.8 * Colors::WHITE,
-                .prob_specular = 0.7  
-            } 
-        },
-        { { 0.0, 0.0,+1.0 }, Material { .diffuse = 0.8 * Colors::WHITE } },        
+    std::vector<const Shape*> lights;
+    ShapeList scene = cornell_box(lights);
+
+    std::cout << &scene << std::endl;    
+
+    BakedScene baked { scene, {
+        .method = BVHBuild::Binned,
+        .max_leaf = 8,
+        .intersect_cost = 1.0 / simd::WIDTH
+    } };
+    std::cout << &baked << std::endl;
+
+    // Created before the frame, whose GL objects need the context until it is destroyed
+    std::optional<Window> window;
+    if(!headless) window.emplace(ivec2 { 1024, 1024 });
+
+    ivec2 frame_size = { width, height };
+    std::optional<Frame> frame;
+    TiledExrWriter tiled_output;
+    if(tiled.empty()) {
+        frame.emplace(frame_size);
+        frame->set_exposure(exposure);
+        frame->set_tonemap(tonemap.value_or(Tonemap::None));
+        frame->set_denoise(denoise);
+        if(!aovs.empty()) frame->enable_features();
+    }
+    else if(!tiled_output.open(tiled, frame_size, std::max(1, render_options.tile_size))) {
+        return 1;
+    }
+    bool features = frame && frame->has_features();
+
+    // Resolve and denoise run here, apart from the render workers
+    ThreadPool display_pool { render_options.threads };
+    ParallelFor display_for = [&](size_t count, const std::function<void(size_t)>& fn) {
+        display_pool.parallel_for(count, [&](size_t index, size_t worker) { fn(index); });
     };
-    for (auto [pos, material] : planes) {
-        scene.add(
-            Plane{}
-                .with_pos(pos)
-                .with_dir(-pos)
-                .with_material(material)
-                .build()
-        );
-    }
-
-    Diamond bulb = Diamond{}
-        .with_pos({ 1.0, 0.99, 1.0 })
-        .with_a({ 0.25, 0.0, 0.0 })
-        .with_b({ 0.0, 0.0, 0.25 })
-        .with_material({
-            .emission = Color { 10.0, 10.0, 10.0 }
-        });
 
-    scene.add(bulb.build());
-    std::vector<const Shape*> lights = {
-        &bulb
+    // Processes sharing a checkpoint or a render farm must agree on the scene
+    // and on every setting that changes samples
+    std::ostringstream settings;
+    settings << &scene << wavefront << " " << min_depth << " " << max_depth << " " << sampler_name
+        << " " << render_options.tile_size << " " << adaptive << " " << features
+        << " " << frame_size.x << " " << frame_size.y;
+    auto fnv1a = [](const std::string& text) {
+        u64 hash = 14695981039346656037ull;
+        for(char c : text) {
+            hash = (hash ^ static_cast<u8>(c)) * 1099511628211ull;
+        }
+        return hash;
     };
+    u64 scene_hash = fnv1a(settings.str());
 
-    std::cout << &scene << std::endl;    
+    auto report_samples = [&] {
+        GridSpan<const u32> samples = frame->get_samples();
+        u64 total = 0;
+        u32 max = 0;
+        for(u32 count : samples.data) {
+            total += count;
+            max = std::max(max, count);
+        }
+        std::cout << "samples per pixel: mean " << Float(total) / samples.data.size()
+            << ", max " << max << std::endl;
+
+        if(!heatmap.empty()) {
+            save_image(heatmap, sample_heatmap(samples), 0.0, Tonemap::None);
+        }
+    };
+
+    auto save_outputs = [&] {
+        frame->resolve(display_for);
+        bool saved = true;
+        for(const std::string& path : outputs) {
+            saved = save_image(path, frame->get_resolved(), exposure, tonemap.value_or(Tonemap::None)) && saved;
+        }
+        if(!aovs.empty()) {
+            const Grid2D<Features>& guides = frame->get_features();
+            Grid2D<RGB> albedo(guides.size, { 0.0, 0.0, 0.0 });
+            Grid2D<RGB> normal(guides.size, { 0.0, 0.0, 0.0 });
+            Grid2D<RGB> depth(guides.size, { 0.0, 0.0, 0.0 });
+            for(size_t i = 0; i < guides.data.size(); i++) {
+                const Features& guide = guides.data[i];
+                albedo.data[i] = RGB::from(guide.albedo);
+                normal.data[i] = RGB::from(Color::from(guide.normal));
+                depth.data[i] = RGB::from(Color(guide.depth));
+            }
+            saved = save_pfm(aovs + ".albedo.pfm", albedo) && saved;
+            saved = save_pfm(aovs + ".normal.pfm", normal) && saved;
+            saved = save_pfm(aovs + ".depth.pfm", depth) && saved;
+        }
+        return saved;
+    };
+
+    if(!serve.empty()) {
+        Listener listener;
+        if(!listener.listen(serve)) return 1;
+        std::cout << "coordinator: waiting for " << farm_workers << " workers on " << serve << std::endl;
+
+        auto start = std::chrono::steady_clock::now();
+        u32 passes = 0;
+        bool complete = serve_farm(listener, farm_workers, scene_hash, render_options.passes, *frame, passes);
+
+        // Without any passes there is nothing to save, and earlier outputs are left in place
+        if(passes == 0) {
+            std::cerr << "Error: No worker sent its passes, nothing saved" << std::endl;
+            return 1;
+        }
+        Float seconds = std::chrono::duration<Float>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "passes: " << passes << " from " << farm_workers << " workers in " << seconds << "s"
+            << ", noise: " << frame->noise() << std::endl;
+
+        // A short render is still saved, but reported as a failure
+        report_samples();
+        return save_outputs() && complete ? 0 : 1;
+    }
+
+    Connection coordinator;
+    if(!connect.empty()) {
+        if(!join_farm(coordinator, connect, scene_hash, frame_size, render_options)) return 1;
+        std::cout << "worker " << render_options.pass_offset << " of " << render_options.pass_stride << ": "
+            << render_options.passes << " passes" << std::endl;
+    }
+    auto send_result = [&](u32 passes) {
+        return send_farm_result(coordinator, passes, *frame);
+    };
+    // With more workers than passes some have nothing to do, and 0 passes would never end
+    if(coordinator.is_open() && render_options.passes == 0) {
+        return send_result(0) ? 0 : 1;
+    }
+
+    // Workers publish their path counters after every tile
+    std::atomic<u64> total_paths = 0;
+    std::atomic<u64> total_segments = 0;
+    auto publish = [&](PathStats& stats) {
+        total_paths += stats.paths;
+        total_segments += stats.segments;
+        stats = {};
+    };
+
+    Renderer renderer { frame_size, render_options };
+    std::cout << "threads: " << renderer.thread_count() << std::endl;
+
+    // Checkpoints also depend on the passes a farm worker takes
+    if(frame && !checkpoint.empty()) {
+        settings << " " << render_options.pass_offset << " " << render_options.pass_stride;
+        if(!frame->open_checkpoint(checkpoint, fnv1a(settings.str()), renderer.tile_count())) return 1;
+        std::span<u32> progress = frame->get_progress();
+        if(!progress.empty()) {
+            std::cout << "checkpoint: " << *std::min_element(progress.begin(), progress.end())
+                << " passes done" << std::endl;
+        }
+    }
+
+    struct WorkerState {
+        std::unique_ptr<Sampler> sampler;
+        Integrator solver;
+        WavefrontIntegrator wavefront;
+
+        std::vector<Ray> rays;
+        std::vector<Vec2f> uvs;
+        std::vector<Spectrum> samples;
+        std::vector<FirstHit> first_hits;
+
+        /// Splats of the current tile, merged into the frame when it is done
+        TileBuffer buffer;
+    };
+    std::vector<WorkerState> states(renderer.thread_count());
+    for(auto& state : states) {
+        if(sampler_name == "sobol") {
+            state.sampler = std::make_unique<SobolSampler>();
+        }
+        else if(sampler_name == "bluenoise") {
+            state.sampler = std::make_unique<BlueNoiseSampler>();
+        }
+        else {
+            state.sampler = std::make_unique<RandomSampler>();
+        }
 
-    Window window { { 1024, 1024 } };
-    Frame frame { { 512, 512 } };
-
-    std::vector<std::thread> workers;
-    for(size_t i = 0; i < 12; i++) {
-        workers.emplace_back([&frame, &scene, &lights]{
-            Integrator solver;
-            solver.scene = &scene;
-            solver.lights = lights;
-
-            Random rng;
-
-            Vec2f  size = frame.get_size().cast<Float>();
-            Float aspect = size.x / size.y;
-
-            while(true) {
-                for(size_t j = 0; j < 256; j++) {
-                    for(size_t i = 0; i < 256; i++) {
-                        Vec2f uv = (Vec2f(i, j) + rng.unit2D()) * (1.0 / 256.0);
-
-                        Vec2f screen = { 
-                            (2.0f * uv.x - 1.0f) * aspect,
-                            (2.0f * uv.y - 1.0f)
-                        };
-                        Ray ray = {
-                            .pos = Vec3f(0.0, 0.0, -0.95),
-                            .dir = screen.with_z(1.0).unit()
-                        };
-
-                        Color sample = solver.pathtrace(ray);
-                        frame.add_bilinear(uv, sample);
+        state.buffer.with_features = features;
+
+        state.solver.scene = &baked;
+        state.solver.lights = lights;
+        state.solver.min_depth = min_depth;
+        state.solver.max_depth = max_depth;
+        state.solver.sampler = state.sampler.get();
+
+        state.wavefront.scene = &baked;
+        state.wavefront.lights = lights;
+        state.wavefront.min_depth = min_depth;
+        state.wavefront.max_depth = max_depth;
+    }
+
+    Vec2f size = frame_size.cast<Float>();
+    Float aspect = size.x / size.y;
+
+    auto camera = [aspect](Vec2f uv) -> Ray {
+        Vec2f screen = { 
+            (2.0f * uv.x - 1.0f) * aspect,
+            (2.0f * uv.y - 1.0f)
+        };
+        return {
+            .pos = Vec3f(0.0, 0.0, -0.95),
+            .dir = screen.with_z(1.0).unit()
+        };
+    };
+
+    // One camera sample per pixel and pass, the pass is the sample index
+    // Camera rays are generated in 4x4 blocks, keeping neighbours coherent
+    // Adaptive renders leave out converged pixels
+    auto for_each_uv = [&](const Tile& tile, u32 pass, WorkerState& state, auto fn) {
+        Sampler& sampler = *state.sampler;
+        bool retire = adaptive > 0.0 && pass >= ADAPTIVE_MIN_PASSES;
+
+        for(i32 pj = tile.begin.y; pj < tile.end.y; pj += 4) {
+            for(i32 pi = tile.begin.x; pi < tile.end.x; pi += 4) {
+                for(i32 j = pj; j < std::min(pj + 4, tile.end.y); j++) {
+                    for(i32 i = pi; i < std::min(pi + 4, tile.end.x); i++) {
+                        if(retire && frame->converged(i, j, adaptive)) continue;
+
+                        state.buffer.count_sample(i, j);
+                        sampler.start(i, j, pass);
+                        Vec2f jitter = sampler.get2D();
+                        fn(i, j, Vec2f((i + jitter.x) / size.x, (j + jitter.y) / size.y));
                     }
                 }
             }
+        }
+    };
+
+    auto add_features = [&](TileBuffer& buffer, Vec2f uv, const FirstHit& first) {
+        buffer.add_features(uv, frame_size, { first.albedo, first.normal, first.depth });
+    };
+
+    // Progressive tiles merge into the frame every pass, tiled ones are written after their last
+    auto finish_tile = [&](const Tile& tile, u32 pass, const TileBuffer& buffer) {
+        if(frame) {
+            frame->merge(buffer);
+            return;
+        }
+        if(pass + 1 < render_options.passes) return;
+
+        // The buffer starts one pixel before the tile
+        Grid2D<RGB> pixels({ tile.end.x - tile.begin.x, tile.end.y - tile.begin.y }, { 0.0, 0.0, 0.0 });
+        for(i32 j = 0; j < pixels.size.y; j++) {
+            for(i32 i = 0; i < pixels.size.x; i++) {
+                Float weight = buffer.weight.get(i + 1, j + 1);
+                if(weight > 0.0) pixels.get(i, j) = RGB::from(buffer.sum.get(i + 1, j + 1) / weight);
+            }
+        }
+        tiled_output.write_tile(tile.begin, pixels);
+    };
+
+    renderer.start([&](const Tile& tile, u32 pass, size_t worker) {
+        WorkerState& state = states[worker];
+        Sampler& sampler = *state.sampler;
+
+        // Tiled renders sum a tile over all its passes, and also sample the ring of
+        // pixels around it, whose splats reach into the tile, so tile edges come out
+        // as in a full frame
+        Tile area = tile;
+        if(frame || pass == 0) state.buffer.reset(tile.begin, tile.end);
+        if(!frame) {
+            area.begin = { std::max(tile.begin.x - 1, 0), std::max(tile.begin.y - 1, 0) };
+            area.end = { std::min(tile.end.x + 1, frame_size.x), std::min(tile.end.y + 1, frame_size.y) };
+        }
+
+        if(wavefront) {
+            state.rays.clear();
+            state.uvs.clear();
+            for_each_uv(area, pass, state, [&](i32 i, i32 j, Vec2f uv) {
+                state.uvs.push_back(uv);
+                state.rays.push_back(camera(uv));
+            });
+
+            state.wavefront.pathtrace(state.rays, state.samples, features ? &state.first_hits : nullptr);
+            for(size_t k = 0; k < state.samples.size(); k++) {
+                state.buffer.add_bilinear(state.uvs[k], frame_size, state.samples[k]);
+                if(features) add_features(state.buffer, state.uvs[k], state.first_hits[k]);
+            }
+            finish_tile(tile, pass, state.buffer);
+            publish(state.wavefront.stats);
+            return;
+        }
+
+        // Primary rays are traced as 4x4 packets, bounces one ray at a time
+        RayPacket packet;
+        Vec2f uvs[RayPacket::SIZE];
+        ivec2 pixels[RayPacket::SIZE];
+        Intersection hits[RayPacket::SIZE];
+
+        auto trace = [&] {
+            baked.intersect_packet(packet, hits);
+            for(size_t k = 0; k < packet.count; k++) {
+                // Paths continue the pixel sample after its camera dimension
+                sampler.start(pixels[k].x, pixels[k].y, pass, 1);
+                FirstHit first;
+                Color sample = state.solver.pathtrace(packet.rays[k], hits[k], features ? &first : nullptr);
+                state.buffer.add_bilinear(uvs[k], frame_size, sample);
+                if(features) add_features(state.buffer, uvs[k], first);
+            }
+            packet.count = 0;
+        };
+
+        for_each_uv(area, pass, state, [&](i32 i, i32 j, Vec2f uv) {
+            uvs[packet.count] = uv;
+            pixels[packet.count] = { i, j };
+            packet.rays[packet.count++] = camera(uv);
+            if(packet.count == RayPacket::SIZE) trace();
         });
+        // Partial blocks at the frame edge leave a partial packet
+        if(packet.count > 0) trace();
+
+        finish_tile(tile, pass, state.buffer);
+        publish(state.solver.stats);
+    }, [&, last_checkpoint = std::chrono::steady_clock::now()](u32 passes) mutable {
+        if(!frame) return;
+        auto now = std::chrono::steady_clock::now();
+        if(now - last_checkpoint >= std::chrono::duration<Float>(checkpoint_every)) {
+            last_checkpoint = now;
+            frame->checkpoint();
+        }
+    }, frame ? frame->get_progress() : std::span<u32>());
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return std::chrono::duration<Float>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // Rates are over the time since the previous report, `force` reports regardless
+    telemetry::Snapshot last_telemetry;
+    Float last_telemetry_time = 0.0;
+    auto report_telemetry = [&](bool force) {
+        Float now = elapsed();
+        if(telemetry_every <= 0.0 || (!force && now - last_telemetry_time < telemetry_every)) return;
+
+        telemetry::Snapshot totals = telemetry::totals();
+        Float seconds = now - last_telemetry_time;
+        telemetry::write_json(std::cout, totals, last_telemetry, seconds);
+        if(window) {
+            u64 rays = totals.values[telemetry::Rays] - last_telemetry.values[telemetry::Rays];
+            u64 hits = totals.values[telemetry::Hits] - last_telemetry.values[telemetry::Hits];
+            std::ostringstream title;
+            title << "PathSpace - " << rays / seconds / 1e6 << " Mrays/s, "
+                << 100.0 * hits / std::max<u64>(rays, 1) << "% hits";
+            window->set_title(title.str());
+        }
+        last_telemetry = totals;
+        last_telemetry_time = now;
+    };
+
+    if(headless) {
+        // Noise is estimated once a second, after a few passes so every pixel has samples
+        Float last_noise_check = 0.0;
+        while(!renderer.done()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+            if(s_stop) renderer.cancel();
+            if(time_budget > 0.0 && elapsed() >= time_budget) renderer.cancel();
+            if(noise_budget > 0.0 && renderer.passes_done() >= 4 && elapsed() - last_noise_check >= 1.0) {
+                last_noise_check = elapsed();
+                if(frame->noise() <= noise_budget) renderer.cancel();
+            }
+            report_telemetry(false);
+        }
+        renderer.wait();
+        Float seconds = elapsed();
+        report_telemetry(true);
+
+        PathStats stats = { .paths = total_paths, .segments = total_segments };
+        std::cout << "passes: " << renderer.passes_done() << " in " << seconds << "s";
+        if(frame) std::cout << ", noise: " << frame->noise();
+        std::cout << std::endl;
+        std::cout << "samples/s: " << stats.paths / seconds 
+            << ", rays/s: " << stats.segments / seconds
+            << " (path segments, shadow rays not counted)" << std::endl;
+
+        if(!frame) return tiled_output.close() ? 0 : 1;
+        frame->checkpoint();
+
+        report_samples();
+
+        if(coordinator.is_open()) return send_result(renderer.passes_done()) ? 0 : 1;
+        return save_outputs() ? 0 : 1;
     }
 
-    while(!window.should_close()) {
+    auto last_report = std::chrono::steady_clock::now();
+    while(!window->should_close() && !s_stop) {
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glClearColor(0.1, 0.1, 0.1, 1.0);
 
-        frame.render();        
-        window.update();
-    }
+        frame->render(display_for);
+        window->update();
+        report_telemetry(false);
 
-    for(auto& worker : workers) {
-        worker.join();
+        auto now = std::chrono::steady_clock::now();
+        if(now - last_report > std::chrono::seconds(5)) {
+            last_report = now;
+
+            PathStats stats = { .paths = total_paths, .segments = total_segments };
+            std::cout << "passes: " << renderer.passes_done()
+                << ", paths: " << stats.paths << ", mean length: " << stats.mean_length()
+                << " (depth " << min_depth << ".." << max_depth << ")" << std::endl;
+        }
     }
 
+    // Worker states and the frame outlive the render
+    renderer.cancel();
+    renderer.wait();
+    frame->checkpoint();
+    report_samples();
+    report_telemetry(true);
+
     return 0;
 }
@@ -0,0 +1,84 @@
+#pragma once
+#include "vector.hpp"
+#include <limits>
+
+/// Axis aligned bounding box
+template<typename T>
+struct Bounds3 {
+    Vector3<T> min;
+    Vector3<T> max;
+
+    Bounds3()
+    : min(Vector3<T>::splat( std::numeric_limits<T>::infinity()))
+    , max(Vector3<T>::splat(-std::numeric_limits<T>::infinity()))
+    {}
+    Bounds3(Vector3<T> min, Vector3<T> max): min(min), max(max) {}
+
+    static Bounds3 empty() {
+        return {};
+    }
+    static Bounds3 infinite() {
+        return {
+            Vector3<T>::splat(-std::numeric_limits<T>::infinity()),
+            Vector3<T>::splat( std::numeric_limits<T>::infinity())
+        };
+    }
+    static Bounds3 point(Vector3<T> pos) {
+        return { pos, pos };
+    }
+
+    Bounds3 merge(const Bounds3& rhs) const {
+        return { min.min(rhs.min), max.max(rhs.max) };
+    }
+    Bounds3 merge(Vector3<T> pos) const {
+        return { min.min(pos), max.max(pos) };
+    }
+
+    bool is_empty() const {
+        return max.x < min.x || max.y < min.y || max.z < min.z;
+    }
+    bool is_finite() const {
+        return std::isfinite(min.x) && std::isfinite(min.y) && std::isfinite(min.z)
+            && std::isfinite(max.x) && std::isfinite(max.y) && std::isfinite(max.z);
+    }
+
+    Vector3<T> extent() const {
+        return max - min;
+    }
+    Vector3<T> centroid() const {
+        return T(0.5) * (min + max);
+    }
+    T surface_area() const {
+        if(is_empty()) return T(0);
+
+        Vector3<T> d = extent();
+        return T(2) * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+    size_t max_axis() const {
+        Vector3<T> d = extent();
+        if(d.x >= d.y && d.x >= d.z) return 0;
+        if(d.y >= d.z) return 1;
+        return 2;
+    }
+
+    /// Slab test against a ray given by origin and reciprocal direction
+    /// NaNs from flat boxes (0 * inf) are ignored, keeping the test conservative
+    bool hit(const Vector3<T>& pos, const Vector3<T>& inv_dir, T tmax) const {
+        T tnear = T(0);
+        T tfar  = tmax;
+        for(size_t i = 0; i < 3; i++) {
+            T t0 = (min.unsafe_get(i) - pos.unsafe_get(i)) * inv_dir.unsafe_get(i);
+            T t1 = (max.unsafe_get(i) - pos.unsafe_get(i)) * inv_dir.unsafe_get(i);
+
+            T lo = (t1 < t0) ? t1 : t0;
+            T hi = (t1 < t0) ? t0 : t1;
+            tnear = (lo > tnear) ? lo : tnear;
+            tfar  = (hi < tfar)  ? hi : tfar;
+        }
+        return tnear <= tfar;
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const Bounds3& bounds) {
+        return out << "{" << bounds.min << ".." << bounds.max << "}";
+    }
+};
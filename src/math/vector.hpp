@@ -128,6 +128,25 @@ struct ImplVector {
         return component * component.dot(impl());
     }
 
+    Vector min(const Vector& rhs) const {
+        Vector out;
+        for(size_t i = 0; i < impl().len(); i++) {
+            Field a = impl().unsafe_get(i);
+            Field b = rhs.unsafe_get(i);
+            out.unsafe_get(i) = (b < a) ? b : a;
+        }
+        return out;
+    }
+    Vector max(const Vector& rhs) const {
+        Vector out;
+        for(size_t i = 0; i < impl().len(); i++) {
+            Field a = impl().unsafe_get(i);
+            Field b = rhs.unsafe_get(i);
+            out.unsafe_get(i) = (a < b) ? b : a;
+        }
+        return out;
+    }
+
     Vector facing(const Vector& direction) const {
         if (this->dot(direction) >= Field(0.0)) {
             return impl();
@@ -17,10 +17,12 @@ using f32 = float;
 using f64 = double;
 
 #include "math/vector.hpp"
+#include "math/bounds.hpp"
 
 using Float = f64;
 using Vec2f = Vector2<Float>;
 using Vec3f = Vector3<Float>;
+using Bounds3f = Bounds3<Float>;
 
 using vec2  = Vector2<f32>;
 using vec3  = Vector3<f32>;
@@ -67,6 +69,11 @@ namespace Colors {
     constexpr Color YELLOW  = { 1.0, 1.0, 0.0 };
 };
 
+/// Rec. 709 relative luminance of linear RGB
+inline f64 luminance(const Color& color) {
+    return 0.2126 * color.r + 0.7152 * color.g + 0.0722 * color.b;
+}
+
 
 
 #include <memory>
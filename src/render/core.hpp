@@ -0,0 +1,255 @@
+#pragma once
+#include "../core.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <thread>
+
+/// Breadth first alternative to Integrator::pathtrace
+/// Every path in a batch advances one bounce per stage, with path state kept
+/// as structure of arrays queues. Between intersection and shading the hits
+/// are sorted by material, so shading walks each material's paths together.
+struct WavefrontIntegrator {
+    /// Paths are not tied to pixels here, so they take independent samples
+    RandomSampler sampler;
+    const Shape* scene;
+    std::vector<const Shape*> lights;
+    size_t min_depth = 3;
+    size_t max_depth = 10;
+    PathStats stats;
+
+    /// Traces one path per ray, writing its radiance to out[i]
+    /// and, if `first` is set, the features of its first hit to (*first)[i]
+    void pathtrace(const std::vector<Ray>& rays, std::vector<Spectrum>& out, std::vector<FirstHit>* first = nullptr);
+
+private:
+    struct Queue {
+        std::vector<Vec3f> pos;
+        std::vector<Vec3f> dir;
+        std::vector<Spectrum> throughput;
+        std::vector<Float> pdf;
+        std::vector<u32> path;
+
+        size_t size() const { return path.size(); }
+        void clear();
+        /// `pdf` is the BSDF density of `ray`, 0 for camera rays
+        void push(const Ray& ray, Spectrum throughput, Float pdf, u32 path);
+        Ray ray(size_t i) const { return { pos[i], dir[i] }; }
+    };
+
+    void intersect(const Queue& queue);
+    void sort_by_material();
+    void shade(const Queue& queue, Queue& next, std::vector<Spectrum>& out, bool roulette);
+
+    Queue m_current;
+    Queue m_next;
+    std::vector<Intersection> m_hits;
+    std::vector<u32> m_order;
+};
+
+/// Owen scrambled 2D Sobol points, padded over dimensions
+/// Every dimension scrambles and shuffles the sequence with its own hash seed,
+/// so the first n samples of a pixel are stratified in each dimension pair
+struct SobolSampler : public Sampler {
+    u32 seed = 0;
+
+    void start(u32 x, u32 y, u32 index, u32 dim = 0) override;
+    Float get1D() override;
+    Vec2f get2D() override;
+
+private:
+    u32 m_pixel = 0;
+    u32 m_index = 0;
+    u32 m_dim = 0;
+};
+
+/// Blue noise mask tiled over the screen, rotated per sample by a low discrepancy sequence
+/// Error at low sample counts shows up as high frequency noise between neighbouring pixels
+struct BlueNoiseSampler : public Sampler {
+    /// Side of the tiled mask, built once by void and cluster
+    static constexpr u32 SIZE = 64;
+
+    void start(u32 x, u32 y, u32 index, u32 dim = 0) override;
+    Float get1D() override;
+    Vec2f get2D() override;
+
+private:
+    Float mask(u32 component) const;
+
+    u32 m_x = 0;
+    u32 m_y = 0;
+    u32 m_index = 0;
+    u32 m_dim = 0;
+};
+
+/// Fixed set of worker threads, each with its own queue of task indices
+/// Workers take from the front of their own queue and steal from the back of others
+struct ThreadPool {
+    using Task = std::function<void(size_t index, size_t worker)>;
+
+    /// 0 threads: one per hardware thread
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return m_workers.size();
+    }
+
+    /// Runs task(i, worker) for every i in [0, count) and returns once all are done
+    /// Indices start out split into contiguous runs, one per worker
+    /// Only one thread may call this at a time
+    void parallel_for(size_t count, Task task);
+
+private:
+    struct alignas(64) Queue {
+        std::mutex lock;
+        std::deque<size_t> items;
+    };
+
+    void work(size_t worker);
+    bool pop(size_t worker, size_t& index);
+
+    std::vector<std::thread> m_workers;
+    std::unique_ptr<Queue[]> m_queues;
+
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    Task m_task;
+    u64 m_generation = 0;
+    std::atomic<size_t> m_remaining = 0;
+    bool m_stop = false;
+};
+
+/// Pixel range [begin, end) of the frame
+struct Tile {
+    ivec2 begin;
+    ivec2 end;
+};
+
+struct RenderOptions {
+    i32 tile_size = 32;
+    /// 0 passes: render until cancelled
+    u32 passes = 0;
+    /// Pass k takes sample index pass_offset + k * pass_stride, so renderers in
+    /// several processes can split the samples of one frame between them
+    u32 pass_offset = 0;
+    u32 pass_stride = 1;
+    /// 0 threads: one per hardware thread
+    size_t threads = 0;
+    /// Every tile takes all its passes in a row on one worker, rather than every
+    /// tile taking a pass before the next, so tiles finish one by one. Needs passes,
+    /// and leaves out pass callbacks and progress counts
+    bool tile_major = false;
+};
+
+/// Renders the frame in passes, every pass one task per tile on a work stealing pool
+/// Passes run on a driver thread, so the caller stays free to display progress
+struct Renderer {
+    /// Renders one tile for sample index `pass`, `worker` indexes per thread state
+    using TileFn = std::function<void(const Tile& tile, u32 pass, size_t worker)>;
+    /// Called on the driver thread after every complete pass, with the passes done
+    /// No tile runs meanwhile, so the frame holds exactly those passes
+    using PassFn = std::function<void(u32 passes)>;
+
+    Renderer(ivec2 size, RenderOptions options = {});
+    ~Renderer();
+
+    size_t thread_count() const {
+        return m_pool.size();
+    }
+    size_t tile_count() const {
+        return m_tiles.size();
+    }
+    u32 passes_done() const {
+        return m_passes;
+    }
+    bool done() const {
+        return m_done;
+    }
+
+    /// `progress`, if given, holds the passes merged per tile: tiles skip passes they
+    /// already have and count a pass once fn returns. Counts kept from an earlier
+    /// render resume it with every tile and pass rendered exactly once
+    void start(TileFn fn, PassFn on_pass = nullptr, std::span<u32> progress = {});
+    /// Cooperative, tiles already started are finished
+    void cancel();
+    void wait();
+
+private:
+    RenderOptions m_options;
+    ThreadPool m_pool;
+    std::vector<Tile> m_tiles;
+
+    std::thread m_driver;
+    std::atomic<bool> m_cancel = false;
+    std::atomic<bool> m_done = false;
+    std::atomic<u32> m_passes = 0;
+};
+
+/// Byte stream to another process over a Unix domain socket or TCP
+/// Addresses of the form host:port are TCP, anything else is a socket path
+struct Connection {
+    Connection() = default;
+    ~Connection();
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    /// Fails quietly, the other side may not be listening yet
+    bool connect(const std::string& address);
+    void close();
+    bool is_open() const {
+        return m_fd >= 0;
+    }
+
+    /// Receives give up after `seconds` without data, 0 waits indefinitely
+    void set_timeout(Float seconds);
+
+    /// Block until every byte is through, false once the peer is gone or times out
+    bool send(const void* data, size_t size);
+    bool receive(void* data, size_t size);
+
+private:
+    friend struct Listener;
+    int m_fd = -1;
+};
+
+struct Listener {
+    Listener() = default;
+    ~Listener();
+
+    Listener(const Listener&) = delete;
+    Listener& operator=(const Listener&) = delete;
+
+    /// Returns false with a message if the address cannot be bound
+    bool listen(const std::string& address);
+    /// Waits for the next peer
+    bool accept(Connection& connection);
+
+private:
+    int m_fd = -1;
+    /// Socket file, removed again on destruction
+    std::string m_path;
+};
+
+/// Render farm coordinator: waits on `listener` for `workers` workers of the same scene
+/// hash and frame size, assigns each every count-th of `passes` passes starting at its
+/// index, then merges the frame sums they send back into `frame`
+/// `merged` counts the passes merged. Returns false with a message if a peer cannot be
+/// accepted or a worker's sums are missing
+bool serve_farm(Listener& listener, u32 workers, u64 scene_hash, u32 passes, Frame& frame, u32& merged);
+
+/// Render farm worker: connects to the coordinator at `address`, retrying while it starts,
+/// and sets the pass offset, stride and count of `options` to the share it is assigned
+/// Returns false with a message if no coordinator takes it
+bool join_farm(Connection& coordinator, const std::string& address, u64 scene_hash, ivec2 size, RenderOptions& options);
+/// Answers the coordinator with the passes rendered and the sums of `frame`
+bool send_farm_result(Connection& coordinator, u32 passes, const Frame& frame);
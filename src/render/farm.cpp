@@ -0,0 +1,270 @@
+#include "core.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// Splits host:port, the host defaulting to localhost, false for socket paths
+static bool tcp_address(const std::string& address, std::string& host, std::string& port) {
+    size_t colon = address.rfind(':');
+    if(colon == std::string::npos || colon + 1 == address.size()) return false;
+    for(size_t i = colon + 1; i < address.size(); i++) {
+        if(address[i] < '0' || address[i] > '9') return false;
+    }
+    host = colon == 0 ? "localhost" : address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+/// Calls fn(fd, address, length) with a new socket for every resolved address until it returns true
+template<typename Fn>
+static int open_socket(const std::string& address, bool passive, Fn fn) {
+    std::string host, port;
+    if(!tcp_address(address, host, port)) {
+        sockaddr_un local = {};
+        local.sun_family = AF_UNIX;
+        if(address.size() >= sizeof(local.sun_path)) return -1;
+        std::memcpy(local.sun_path, address.c_str(), address.size() + 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd >= 0 && fn(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local))) return fd;
+        if(fd >= 0) ::close(fd);
+        return -1;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* results = nullptr;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) return -1;
+
+    int fd = -1;
+    for(addrinfo* info = results; info && fd < 0; info = info->ai_next) {
+        fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if(fd < 0) continue;
+        if(!fn(fd, info->ai_addr, info->ai_addrlen)) {
+            ::close(fd);
+            fd = -1;
+            continue;
+        }
+
+        // Messages are few and large, waiting to coalesce them only adds latency
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    freeaddrinfo(results);
+    return fd;
+}
+
+Connection::~Connection() {
+    close();
+}
+
+bool Connection::connect(const std::string& address) {
+    close();
+    m_fd = open_socket(address, false, [](int fd, const sockaddr* address, socklen_t length) {
+        return ::connect(fd, address, length) == 0;
+    });
+    return m_fd >= 0;
+}
+void Connection::close() {
+    if(m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+}
+
+void Connection::set_timeout(Float seconds) {
+    timeval timeout = {};
+    timeout.tv_sec = static_cast<time_t>(seconds);
+    timeout.tv_usec = static_cast<suseconds_t>((seconds - timeout.tv_sec) * 1e6);
+    setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+bool Connection::send(const void* data, size_t size) {
+    auto* bytes = static_cast<const u8*>(data);
+    while(size > 0) {
+        // No SIGPIPE for a peer that went away, the error is returned instead
+        ssize_t sent = ::send(m_fd, bytes, size, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+bool Connection::receive(void* data, size_t size) {
+    auto* bytes = static_cast<u8*>(data);
+    while(size > 0) {
+        ssize_t received = ::recv(m_fd, bytes, size, 0);
+        if(received < 0 && errno == EINTR) continue;
+        if(received <= 0) return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+Listener::~Listener() {
+    if(m_fd >= 0) ::close(m_fd);
+    if(!m_path.empty()) unlink(m_path.c_str());
+}
+
+bool Listener::listen(const std::string& address) {
+    std::string host, port;
+    if(!tcp_address(address, host, port)) {
+        // A socket file left by an earlier run would fail the bind
+        unlink(address.c_str());
+        m_path = address;
+    }
+
+    m_fd = open_socket(address, true, [](int fd, const sockaddr* address, socklen_t length) {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        return bind(fd, address, length) == 0 && ::listen(fd, 16) == 0;
+    });
+    if(m_fd < 0) {
+        std::cerr << "Error: Cannot listen on [" << address << "]" << std::endl;
+        m_path.clear();
+        return false;
+    }
+    return true;
+}
+
+bool Listener::accept(Connection& connection) {
+    connection.close();
+    do {
+        connection.m_fd = ::accept(m_fd, nullptr, nullptr);
+    } while(connection.m_fd < 0 && errno == EINTR);
+    return connection.m_fd >= 0;
+}
+
+
+
+namespace {
+    /// Farm messages, raw structs between machines of one byte order
+    /// A worker says hello, is assigned every count-th pass starting at its index
+    /// (count 0 turns it away), and answers with its passes and frame sums
+    struct FarmHello {
+        char magic[8];
+        u64 scene_hash;
+        i32 width;
+        i32 height;
+    };
+    struct FarmAssignment {
+        u32 index;
+        u32 count;
+        u32 passes;
+    };
+    struct FarmResult {
+        u32 passes;
+        u64 bytes;
+    };
+    constexpr char FARM_MAGIC[8] = { 'P', 'S', 'F', 'A', 'R', 'M', '0', '1' };
+    /// Peers that connect without a hello within this time are dropped
+    constexpr Float FARM_HELLO_SECONDS = 10.0;
+}
+
+bool serve_farm(Listener& listener, u32 workers, u64 scene_hash, u32 passes, Frame& frame, u32& merged) {
+    merged = 0;
+    ivec2 size = frame.get_size();
+
+    std::vector<Connection> connections(workers);
+    for(u32 index = 0; index < workers;) {
+        Connection& worker = connections[index];
+        // Interrupts are retried by accept, anything else would fail again at once
+        if(!listener.accept(worker)) {
+            std::cerr << "Error: Cannot accept workers [" << std::strerror(errno) << "]" << std::endl;
+            return false;
+        }
+        worker.set_timeout(FARM_HELLO_SECONDS);
+        FarmHello hello;
+        if(!worker.receive(&hello, sizeof(hello))) {
+            std::cerr << "Error: Peer sent no hello, dropped" << std::endl;
+            worker.close();
+            continue;
+        }
+
+        bool match = std::memcmp(hello.magic, FARM_MAGIC, sizeof(FARM_MAGIC)) == 0
+            && hello.scene_hash == scene_hash
+            && hello.width == size.x && hello.height == size.y;
+        FarmAssignment assignment = { index, match ? workers : 0, passes };
+        if(!worker.send(&assignment, sizeof(assignment))) {
+            std::cerr << "Error: Worker left before its assignment was sent" << std::endl;
+            worker.close();
+            continue;
+        }
+        if(!match) {
+            std::cerr << "Error: Worker turned away, its scene or settings differ" << std::endl;
+            worker.close();
+            continue;
+        }
+        // Results take as long as the render, a worker that dies closes the connection
+        worker.set_timeout(0.0);
+        index++;
+    }
+
+    // Sums add up exactly as if the passes had been merged here
+    Frame part { size };
+    if(frame.has_features()) part.enable_features();
+    std::span<u8> sums = part.get_sums();
+    bool complete = true;
+    for(u32 index = 0; index < workers; index++) {
+        FarmResult result;
+        bool received = connections[index].receive(&result, sizeof(result))
+            && result.bytes == sums.size()
+            && connections[index].receive(sums.data(), sums.size());
+        if(!received) {
+            std::cerr << "Error: Worker " << index << " sent no frame, its passes are missing" << std::endl;
+            complete = false;
+            continue;
+        }
+        frame.merge(part);
+        merged += result.passes;
+    }
+    return complete;
+}
+
+bool join_farm(Connection& coordinator, const std::string& address, u64 scene_hash, ivec2 size, RenderOptions& options) {
+    // Workers may start before the coordinator listens
+    for(int attempt = 0; attempt < 100 && !coordinator.connect(address); attempt++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    FarmHello hello = {};
+    std::memcpy(hello.magic, FARM_MAGIC, sizeof(FARM_MAGIC));
+    hello.scene_hash = scene_hash;
+    hello.width = size.x;
+    hello.height = size.y;
+
+    FarmAssignment assignment;
+    bool joined = coordinator.is_open()
+        && coordinator.send(&hello, sizeof(hello))
+        && coordinator.receive(&assignment, sizeof(assignment))
+        && assignment.count > 0;
+    if(!joined) {
+        std::cerr << "Error: No coordinator took this worker [" << address << "]" << std::endl;
+        return false;
+    }
+
+    options.pass_offset = assignment.index;
+    options.pass_stride = assignment.count;
+    options.passes = (assignment.passes + assignment.count - 1 - assignment.index) / assignment.count;
+    return true;
+}
+
+bool send_farm_result(Connection& coordinator, u32 passes, const Frame& frame) {
+    std::span<const u8> sums = frame.get_sums();
+    // Zeroed whole, aggregate initialization may leave the padding with stack bytes
+    FarmResult result;
+    std::memset(&result, 0, sizeof(result));
+    result.passes = passes;
+    result.bytes = sums.size();
+    return coordinator.send(&result, sizeof(result)) && coordinator.send(sums.data(), sums.size());
+}
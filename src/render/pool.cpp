@@ -0,0 +1,92 @@
+#include "core.hpp"
+
+ThreadPool::ThreadPool(size_t threads) {
+    if(threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    m_queues = std::make_unique<Queue[]>(threads);
+    for(size_t i = 0; i < threads; i++) {
+        m_workers.emplace_back([this, i] { work(i); });
+    }
+}
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for(auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallel_for(size_t count, Task task) {
+    if(count == 0) return;
+
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_task = std::move(task);
+    m_remaining = count;
+
+    // Contiguous runs keep neighbouring tasks on one worker until it is stolen from
+    size_t n = size();
+    for(size_t w = 0; w < n; w++) {
+        std::lock_guard<std::mutex> queue_guard(m_queues[w].lock);
+        for(size_t i = count * w / n; i < count * (w + 1) / n; i++) {
+            m_queues[w].items.push_back(i);
+        }
+    }
+
+    m_generation++;
+    m_wake.notify_all();
+    m_done.wait(guard, [this] { return m_remaining == 0; });
+    m_task = nullptr;
+}
+
+bool ThreadPool::pop(size_t worker, size_t& index) {
+    {
+        Queue& own = m_queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if(!own.items.empty()) {
+            index = own.items.front();
+            own.items.pop_front();
+            return true;
+        }
+    }
+
+    // Steal the far end of a victim's run, away from where it is working
+    size_t n = size();
+    for(size_t k = 1; k < n; k++) {
+        Queue& victim = m_queues[(worker + k) % n];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(!victim.items.empty()) {
+            index = victim.items.back();
+            victim.items.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t worker) {
+    u64 seen = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            m_wake.wait(guard, [&] { return m_stop || m_generation != seen; });
+            if(m_stop) return;
+            seen = m_generation;
+        }
+
+        size_t index;
+        while(pop(worker, index)) {
+            m_task(index, worker);
+
+            if(m_remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_done.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#include "core.hpp"
+
+Renderer::Renderer(ivec2 size, RenderOptions options)
+: m_options(options)
+, m_pool(options.threads)
+{
+    i32 step = std::max(1, options.tile_size);
+    for(i32 y = 0; y < size.y; y += step) {
+        for(i32 x = 0; x < size.x; x += step) {
+            m_tiles.push_back({ 
+                { x, y }, 
+                { std::min(x + step, size.x), std::min(y + step, size.y) } 
+            });
+        }
+    }
+}
+Renderer::~Renderer() {
+    cancel();
+    wait();
+}
+
+void Renderer::start(TileFn fn, PassFn on_pass, std::span<u32> progress) {
+    m_driver = std::thread([this, fn = std::move(fn), on_pass = std::move(on_pass), progress] {
+        if(m_options.tile_major) {
+            m_pool.parallel_for(m_tiles.size(), [&](size_t index, size_t worker) {
+                for(u32 k = 0; k < m_options.passes && !m_cancel; k++) {
+                    fn(m_tiles[index], m_options.pass_offset + k * m_options.pass_stride, worker);
+                }
+            });
+            if(!m_cancel) m_passes = m_options.passes;
+            m_done = true;
+            return;
+        }
+
+        for(u32 k = 0; m_options.passes == 0 || k < m_options.passes; k++) {
+            if(m_cancel) break;
+            u32 pass = m_options.pass_offset + k * m_options.pass_stride;
+
+            m_pool.parallel_for(m_tiles.size(), [&](size_t index, size_t worker) {
+                if(m_cancel) return;
+                if(!progress.empty() && progress[index] > k) return;
+
+                fn(m_tiles[index], pass, worker);
+                if(!progress.empty()) {
+                    // Counts are of this renderer's passes, not sample indices, which a stride spreads
+                    std::atomic_ref<u32>(progress[index]).store(k + 1, std::memory_order_relaxed);
+                }
+            });
+
+            // Cancelled passes may have skipped tiles
+            if(m_cancel) break;
+            m_passes++;
+            if(on_pass) on_pass(m_passes);
+        }
+        m_done = true;
+    });
+}
+
+void Renderer::cancel() {
+    m_cancel = true;
+}
+void Renderer::wait() {
+    if(m_driver.joinable()) {
+        m_driver.join();
+    }
+}
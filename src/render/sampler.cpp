@@ -0,0 +1,214 @@
+#include "core.hpp"
+
+namespace {
+    // Integer hashes, "lowbias32" by Chris Wellons
+    u32 hash(u32 x) {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+    u32 hash(u32 seed, u32 value) {
+        return hash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+    }
+
+    u32 reverse_bits(u32 x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Hash based Owen scrambling (Burley 2020), each bit is flipped depending
+    // only on the bits above it, which keeps the sequence stratified
+    u32 laine_karras(u32 x, u32 seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+    u32 owen_scramble(u32 x, u32 seed) {
+        return reverse_bits(laine_karras(reverse_bits(x), seed));
+    }
+
+    // First two Sobol dimensions: van der Corput, and the Pascal matrix
+    u32 sobol(u32 index, u32 dim) {
+        if(dim == 0) return reverse_bits(index);
+
+        u32 out = 0;
+        for(u32 v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+            if(index & 1) out ^= v;
+        }
+        return out;
+    }
+
+    Float to_unit(u32 x) {
+        return x * 0x1p-32;
+    }
+
+    // Void and cluster (Ulichney 1993) on a torus, returns the rank of every pixel
+    std::vector<u32> void_and_cluster(u32 size, Float sigma) {
+        const u32 count = size * size;
+
+        // Gaussian energy of a point at the origin, by wrapped offset
+        std::vector<Float> kernel(count);
+        for(u32 y = 0; y < size; y++) {
+            for(u32 x = 0; x < size; x++) {
+                Float dx = std::min(x, size - x);
+                Float dy = std::min(y, size - y);
+                kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0 * sigma * sigma));
+            }
+        }
+
+        std::vector<bool> pattern(count, false);
+        std::vector<Float> energy(count, 0.0);
+        auto splat = [&](u32 p, Float sign) {
+            u32 px = p % size, py = p / size;
+            for(u32 y = 0; y < size; y++) {
+                u32 ky = (y + size - py) % size;
+                for(u32 x = 0; x < size; x++) {
+                    u32 kx = (x + size - px) % size;
+                    energy[y * size + x] += sign * kernel[ky * size + kx];
+                }
+            }
+        };
+        auto set = [&](u32 p, bool value) {
+            pattern[p] = value;
+            splat(p, value ? 1.0 : -1.0);
+        };
+        // Tightest cluster is the densest set pixel, largest void the emptiest unset one
+        auto tightest_cluster = [&]() {
+            u32 best = 0;
+            Float best_energy = -INFINITY;
+            for(u32 p = 0; p < count; p++) {
+                if(pattern[p] && energy[p] > best_energy) {
+                    best = p;
+                    best_energy = energy[p];
+                }
+            }
+            return best;
+        };
+        auto largest_void = [&]() {
+            u32 best = 0;
+            Float best_energy = INFINITY;
+            for(u32 p = 0; p < count; p++) {
+                if(!pattern[p] && energy[p] < best_energy) {
+                    best = p;
+                    best_energy = energy[p];
+                }
+            }
+            return best;
+        };
+
+        // Initial pattern: a tenth of the pixels, relaxed until no point moves
+        pcg32 rng(0x5eed);
+        u32 ones = count / 10;
+        for(u32 placed = 0; placed < ones; ) {
+            u32 p = rng() % count;
+            if(!pattern[p]) {
+                set(p, true);
+                placed++;
+            }
+        }
+        for(u32 i = 0; i < count; i++) {
+            u32 cluster = tightest_cluster();
+            set(cluster, false);
+            u32 hole = largest_void();
+            set(hole, true);
+            if(hole == cluster) break;
+        }
+
+        std::vector<u32> rank(count);
+        std::vector<bool> initial = pattern;
+        std::vector<Float> initial_energy = energy;
+
+        // Ranks below the initial pattern by removing clusters
+        for(u32 r = ones; r-- > 0; ) {
+            u32 cluster = tightest_cluster();
+            set(cluster, false);
+            rank[cluster] = r;
+        }
+
+        // Ranks above by filling voids, the kernel sums to a constant on the torus,
+        // so the largest void of set pixels is also the tightest cluster of unset ones
+        pattern = initial;
+        energy = initial_energy;
+        for(u32 r = ones; r < count; r++) {
+            u32 hole = largest_void();
+            set(hole, true);
+            rank[hole] = r;
+        }
+        return rank;
+    }
+
+    const std::vector<Float>& blue_noise_mask() {
+        static const std::vector<Float> mask = [] {
+            constexpr u32 SIZE = BlueNoiseSampler::SIZE;
+            std::vector<u32> rank = void_and_cluster(SIZE, 1.5);
+
+            std::vector<Float> out(rank.size());
+            for(size_t i = 0; i < rank.size(); i++) {
+                out[i] = (rank[i] + 0.5) / rank.size();
+            }
+            return out;
+        }();
+        return mask;
+    }
+
+    Float fract(Float x) {
+        return x - std::floor(x);
+    }
+}
+
+void SobolSampler::start(u32 x, u32 y, u32 index, u32 dim) {
+    m_pixel = hash(hash(seed, x), y);
+    m_index = index;
+    m_dim = dim;
+}
+Float SobolSampler::get1D() {
+    u32 dim_seed = hash(m_pixel, m_dim++);
+    u32 index = owen_scramble(m_index, hash(dim_seed, 0));
+    return to_unit(owen_scramble(sobol(index, 0), hash(dim_seed, 1)));
+}
+Vec2f SobolSampler::get2D() {
+    u32 dim_seed = hash(m_pixel, m_dim++);
+    u32 index = owen_scramble(m_index, hash(dim_seed, 0));
+    return {
+        to_unit(owen_scramble(sobol(index, 0), hash(dim_seed, 1))),
+        to_unit(owen_scramble(sobol(index, 1), hash(dim_seed, 2)))
+    };
+}
+
+void BlueNoiseSampler::start(u32 x, u32 y, u32 index, u32 dim) {
+    m_x = x;
+    m_y = y;
+    m_index = index;
+    m_dim = dim;
+}
+Float BlueNoiseSampler::mask(u32 component) const {
+    // Every dimension reads the mask at its own toroidal offset
+    u32 offset = hash(m_dim, component);
+    u32 x = (m_x + offset) % SIZE;
+    u32 y = (m_y + (offset >> 16)) % SIZE;
+    return blue_noise_mask()[y * SIZE + x];
+}
+Float BlueNoiseSampler::get1D() {
+    // Golden ratio sequence over samples
+    Float value = fract(mask(0) + m_index * 0.6180339887498949);
+    m_dim++;
+    return value;
+}
+Vec2f BlueNoiseSampler::get2D() {
+    // R2 sequence over samples (Roberts 2018)
+    Vec2f value = {
+        fract(mask(0) + m_index * 0.7548776662466927),
+        fract(mask(1) + m_index * 0.5698402909980532)
+    };
+    m_dim++;
+    return value;
+}
@@ -0,0 +1,100 @@
+#include "core.hpp"
+#include <algorithm>
+
+void WavefrontIntegrator::Queue::clear() {
+    pos.clear();
+    dir.clear();
+    throughput.clear();
+    pdf.clear();
+    path.clear();
+}
+void WavefrontIntegrator::Queue::push(const Ray& ray, Spectrum value, Float density, u32 index) {
+    pos.push_back(ray.pos);
+    dir.push_back(ray.dir);
+    throughput.push_back(value);
+    pdf.push_back(density);
+    path.push_back(index);
+}
+
+void WavefrontIntegrator::pathtrace(const std::vector<Ray>& rays, std::vector<Spectrum>& out, std::vector<FirstHit>* first) {
+    out.assign(rays.size(), Colors::BLACK);
+
+    m_current.clear();
+    for(size_t i = 0; i < rays.size(); i++) {
+        m_current.push(rays[i], Colors::WHITE, 0.0, static_cast<u32>(i));
+    }
+
+    stats.paths += rays.size();
+    for(size_t depth = 0; depth < max_depth && m_current.size() > 0; depth++) {
+        stats.segments += m_current.size();
+        intersect(m_current);
+        if(first && depth == 0) {
+            first->resize(rays.size());
+            for(size_t i = 0; i < m_hits.size(); i++) {
+                (*first)[m_current.path[i]] = FirstHit::from(m_hits[i]);
+            }
+        }
+        sort_by_material();
+
+        // Survivors of Russian roulette are the only paths queued for the next depth
+        m_next.clear();
+        shade(m_current, m_next, out, depth + 1 >= min_depth);
+        telemetry::path_length(depth + 1, m_current.size() - m_next.size());
+        std::swap(m_current, m_next);
+    }
+    // Paths still queued were cut off at max_depth
+    telemetry::path_length(max_depth, m_current.size());
+}
+
+void WavefrontIntegrator::intersect(const Queue& queue) {
+    m_hits.resize(queue.size());
+    telemetry::count(telemetry::Rays, queue.size());
+
+    // Consecutive rays of a fresh batch are coherent camera rays
+    RayPacket packet;
+    for(size_t begin = 0; begin < queue.size(); begin += RayPacket::SIZE) {
+        packet.count = std::min(RayPacket::SIZE, queue.size() - begin);
+        for(size_t k = 0; k < packet.count; k++) {
+            packet.rays[k] = queue.ray(begin + k);
+        }
+        scene->intersect_packet(packet, &m_hits[begin]);
+    }
+}
+
+void WavefrontIntegrator::sort_by_material() {
+    // Misses terminate, hits are grouped by material
+    m_order.clear();
+    for(size_t i = 0; i < m_hits.size(); i++) {
+        if(m_hits[i].hit) {
+            m_order.push_back(static_cast<u32>(i));
+        }
+    }
+
+    telemetry::count(telemetry::Hits, m_order.size());
+    telemetry::count(telemetry::Misses, m_hits.size() - m_order.size());
+
+    std::sort(m_order.begin(), m_order.end(), [this](u32 a, u32 b) {
+        return std::less<const Material*>{}(m_hits[a].local.material, m_hits[b].local.material);
+    });
+}
+
+void WavefrontIntegrator::shade(const Queue& queue, Queue& next, std::vector<Spectrum>& out, bool roulette) {
+    for(u32 i : m_order) {
+        const LocalSurface* surface = &m_hits[i].local;
+        const Spectrum& emission = surface->material->emission;
+        Spectrum& lum = out[queue.path[i]];
+
+        // Same estimator as Integrator::pathtrace
+        if(emission.norm_squared() > 0.0) {
+            Float weight = (queue.pdf[i] > 0.0) ? mis_weight(queue.pdf[i], light_pdf(lights, queue.ray(i), m_hits[i])) : 1.0;
+            lum += weight * queue.throughput[i] * emission;
+        }
+        lum += queue.throughput[i] * sample_direct(&sampler, scene, lights, surface);
+
+        auto [new_ray, BSDF] = surface->material->sample_f(&sampler, surface);
+        Spectrum throughput = queue.throughput[i] * BSDF;
+        if(roulette && !survive_roulette(&sampler, throughput)) continue;
+
+        next.push(new_ray, throughput, surface->material->pdf(surface, new_ray.dir), queue.path[i]);
+    }
+}
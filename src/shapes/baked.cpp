@@ -0,0 +1,402 @@
+#include "core.hpp"
+#include <bit>
+
+namespace {
+    using BakedPlane   = BakedScene::BakedPlane;
+    using BakedSphere  = BakedScene::BakedSphere;
+    using BakedDisc    = BakedScene::BakedDisc;
+    using BakedDiamond = BakedScene::BakedDiamond;
+
+    // Surfaces at a distance found by the block kernels, matching the Shape implementations
+
+    LocalSurface flat_surface(const Unit<Vec3f>& dir, const Ray& ray, Float t, const Material* material) {
+        return {
+            .pos      = ray.pos + ray.dir * t,
+            .normal   = (dir.dot(ray.dir) > 0.0) ? -dir : dir,
+            .material = material,
+        };
+    }
+
+    LocalSurface sphere_surface(const BakedSphere& sphere, const Ray& ray, Float t, const Material* material) {
+        Vec3f x = ray.pos - sphere.pos;
+        Vec3f y = x + t * ray.dir;
+
+        // Rays starting inside see the inner side
+        bool outside = x.norm_squared() >= sphere.radius2;
+        return {
+            .pos      = y + sphere.pos,
+            .normal   = outside ? y.unit() : -y.unit(),
+            .material = material
+        };
+    }
+
+    void set_lane(simd::DiscBlock& block, size_t lane, const BakedPlane& plane) {
+        block.px[lane] = plane.pos.x;
+        block.py[lane] = plane.pos.y;
+        block.pz[lane] = plane.pos.z;
+        block.nx[lane] = plane.dir.x;
+        block.ny[lane] = plane.dir.y;
+        block.nz[lane] = plane.dir.z;
+        block.radius2[lane] = INFINITY;
+    }
+    void set_lane(simd::SphereBlock& block, size_t lane, const BakedSphere& sphere) {
+        block.px[lane] = sphere.pos.x;
+        block.py[lane] = sphere.pos.y;
+        block.pz[lane] = sphere.pos.z;
+        block.radius2[lane] = sphere.radius2;
+    }
+    void set_lane(simd::DiscBlock& block, size_t lane, const BakedDisc& disc) {
+        block.px[lane] = disc.pos.x;
+        block.py[lane] = disc.pos.y;
+        block.pz[lane] = disc.pos.z;
+        block.nx[lane] = disc.dir.x;
+        block.ny[lane] = disc.dir.y;
+        block.nz[lane] = disc.dir.z;
+        block.radius2[lane] = disc.radius2;
+    }
+    void set_lane(simd::DiamondBlock& block, size_t lane, const BakedDiamond& diamond) {
+        block.px[lane] = diamond.pos.x;
+        block.py[lane] = diamond.pos.y;
+        block.pz[lane] = diamond.pos.z;
+        block.nx[lane] = diamond.dir.x;
+        block.ny[lane] = diamond.dir.y;
+        block.nz[lane] = diamond.dir.z;
+        block.ax[lane] = diamond.a_dir.x;
+        block.ay[lane] = diamond.a_dir.y;
+        block.az[lane] = diamond.a_dir.z;
+        block.bx[lane] = diamond.b_dir.x;
+        block.by[lane] = diamond.b_dir.y;
+        block.bz[lane] = diamond.b_dir.z;
+        block.a_norm[lane] = diamond.a_norm;
+        block.b_norm[lane] = diamond.b_norm;
+    }
+
+    /// Packs prims [begin, end) into blocks, returning the block range
+    template<typename Block, typename Prim>
+    std::pair<u32, u32> pack(std::vector<Block>& blocks, const std::vector<Prim>& prims, size_t begin, size_t end, u32 kind) {
+        u32 first = static_cast<u32>(blocks.size());
+        for(size_t i = begin; i < end; i += simd::WIDTH) {
+            Block block = simd::empty_block<Block>();
+            for(size_t lane = 0; lane < simd::WIDTH && i + lane < end; lane++) {
+                set_lane(block, lane, prims[i + lane]);
+                block.prim[lane] = (kind << BakedScene::KIND_SHIFT) | static_cast<u32>(i + lane);
+            }
+            blocks.push_back(block);
+        }
+        return { first, static_cast<u32>(blocks.size()) };
+    }
+}
+
+BakedScene::BakedScene(const ShapeList& list, BVHOptions options) {
+    struct Source {
+        Kind kind;
+        const Shape* shape;
+    };
+
+    std::vector<Source> sources;
+    std::vector<Bounds3f> bounds;
+
+    auto add_material = [this](const Material& material) {
+        materials.push_back(material);
+        return static_cast<u32>(materials.size() - 1);
+    };
+
+    for(auto& shape : list.data) {
+        if(auto plane = dynamic_cast<const Plane*>(shape.get())) {
+            planes.push_back({ plane->m_pos, plane->m_dir, add_material(plane->m_material) });
+            continue;
+        }
+
+        Bounds3f b = shape->bounds();
+        if(!b.is_finite()) {
+            fallback.push_back(shape);
+        }
+        else if(dynamic_cast<const Sphere*>(shape.get())) {
+            sources.push_back({ SPHERE, shape.get() });
+            bounds.push_back(b);
+        }
+        else if(dynamic_cast<const Disc*>(shape.get())) {
+            sources.push_back({ DISC, shape.get() });
+            bounds.push_back(b);
+        }
+        else if(dynamic_cast<const Diamond*>(shape.get())) {
+            sources.push_back({ DIAMOND, shape.get() });
+            bounds.push_back(b);
+        }
+        else {
+            fallback.push_back(shape);
+        }
+    }
+
+    pack(plane_blocks, planes, 0, planes.size(), PLANE);
+    tree.build(bounds, options);
+
+    // Emit primitives leaf by leaf, so each leaf covers one range per type
+    for(auto& node : tree.nodes) {
+        if(node.count == 0) continue;
+
+        size_t sphere_begin  = spheres.size();
+        size_t disc_begin    = discs.size();
+        size_t diamond_begin = diamonds.size();
+
+        for(u32 i = node.offset; i < node.offset + node.count; i++) {
+            const Source& source = sources[tree.order[i]];
+            switch(source.kind) {
+                case SPHERE: {
+                    auto sphere = static_cast<const Sphere*>(source.shape);
+                    spheres.push_back({
+                        .pos      = sphere->m_pos,
+                        .radius2  = sphere->m_radius * sphere->m_radius,
+                        .material = add_material(sphere->m_material)
+                    });
+                    break;
+                }
+                case DISC: {
+                    auto disc = static_cast<const Disc*>(source.shape);
+                    discs.push_back({
+                        .pos      = disc->m_pos,
+                        .dir      = disc->m_dir,
+                        .radius2  = disc->m_radius * disc->m_radius,
+                        .material = add_material(disc->m_material)
+                    });
+                    break;
+                }
+                case DIAMOND: {
+                    auto diamond = static_cast<const Diamond*>(source.shape);
+                    diamonds.push_back({
+                        .pos      = diamond->m_pos,
+                        .dir      = diamond->m_dir,
+                        .a_dir    = diamond->m_a.unit(),
+                        .b_dir    = diamond->m_b.unit(),
+                        .a_norm   = diamond->m_a.norm(),
+                        .b_norm   = diamond->m_b.norm(),
+                        .material = add_material(diamond->m_material)
+                    });
+                    break;
+                }
+                case PLANE: break;
+            }
+        }
+
+        Leaf leaf;
+        std::tie(leaf.sphere_begin, leaf.sphere_end)
+            = pack(sphere_blocks, spheres, sphere_begin, spheres.size(), SPHERE);
+        std::tie(leaf.disc_begin, leaf.disc_end)
+            = pack(disc_blocks, discs, disc_begin, discs.size(), DISC);
+        std::tie(leaf.diamond_begin, leaf.diamond_end)
+            = pack(diamond_blocks, diamonds, diamond_begin, diamonds.size(), DIAMOND);
+
+        node.offset = static_cast<u32>(leaves.size());
+        leaves.push_back(leaf);
+    }
+}
+
+void BakedScene::format(std::ostream& out, size_t indent) const {
+    write_indent(out, indent);
+    out << "BakedScene(planes: " << planes.size()
+        << ", spheres: "  << spheres.size()
+        << ", discs: "    << discs.size()
+        << ", diamonds: " << diamonds.size()
+        << ", fallback: " << fallback.size()
+        << ", materials: " << materials.size()
+        << ", " << tree.stats << ")";
+}
+
+void BakedScene::intersect_leaf(const Leaf& leaf, const simd::RayLanes& ray, simd::BlockHit& hit) const {
+    simd::intersect(sphere_blocks.data() + leaf.sphere_begin, leaf.sphere_end - leaf.sphere_begin, ray, hit);
+    simd::intersect(disc_blocks.data() + leaf.disc_begin, leaf.disc_end - leaf.disc_begin, ray, hit);
+    simd::intersect(diamond_blocks.data() + leaf.diamond_begin, leaf.diamond_end - leaf.diamond_begin, ray, hit);
+}
+
+LocalSurface BakedScene::surface_at(const Ray& ray, const Hit& hit) const {
+    u32 index = hit.prim & ((1u << KIND_SHIFT) - 1);
+    switch(hit.prim >> KIND_SHIFT) {
+        case PLANE: {
+            auto& plane = planes[index];
+            return flat_surface(plane.dir, ray, hit.dist, &materials[plane.material]);
+        }
+        case SPHERE: {
+            auto& sphere = spheres[index];
+            return sphere_surface(sphere, ray, hit.dist, &materials[sphere.material]);
+        }
+        case DISC: {
+            auto& disc = discs[index];
+            return flat_surface(disc.dir, ray, hit.dist, &materials[disc.material]);
+        }
+        case DIAMOND: {
+            auto& diamond = diamonds[index];
+            return flat_surface(diamond.dir, ray, hit.dist, &materials[diamond.material]);
+        }
+    }
+    return {};
+}
+
+Hit BakedScene::hit(const Ray& ray, Float tmax) const {
+    Hit nearest = { .dist = tmax };
+    for(auto& shape : fallback) {
+        Hit current = shape->hit(ray, nearest.dist);
+        if(current.shape) {
+            nearest = current;
+        }
+    }
+
+    simd::RayLanes lanes { ray };
+    simd::BlockHit block_hit { .dist = nearest.dist };
+    simd::intersect(plane_blocks.data(), plane_blocks.size(), lanes, block_hit);
+
+    tree.traverse(ray, block_hit.dist, [&](u32 offset, u32 count) {
+        intersect_leaf(leaves[offset], lanes, block_hit);
+        return false;
+    });
+
+    if(block_hit.hit) return { .dist = block_hit.dist, .shape = this, .prim = block_hit.prim };
+    return nearest;
+}
+
+bool BakedScene::occluded(const Ray& ray, Float tmax) const {
+    for(auto& shape : fallback) {
+        if(shape->occluded(ray, tmax)) return true;
+    }
+
+    // Any lane closer than tmax will do, so leaves stop the traversal on their first hit
+    simd::RayLanes lanes { ray };
+    simd::BlockHit block_hit { .dist = tmax };
+    simd::intersect(plane_blocks.data(), plane_blocks.size(), lanes, block_hit);
+    if(block_hit.hit) return true;
+
+    tree.traverse(ray, tmax, [&](u32 offset, u32 count) {
+        intersect_leaf(leaves[offset], lanes, block_hit);
+        return block_hit.hit;
+    });
+    return block_hit.hit;
+}
+
+void BakedScene::intersect_packet(const RayPacket& packet, Intersection* hits) const {
+    constexpr size_t SIZE   = RayPacket::SIZE;
+    constexpr size_t GROUPS = SIZE / simd::WIDTH;
+    using simd::F64x4;
+
+    // Rays beyond packet.count stay NaN, failing every box test
+    alignas(32) Float ox[SIZE], oy[SIZE], oz[SIZE];
+    alignas(32) Float ix[SIZE], iy[SIZE], iz[SIZE];
+    alignas(32) Float tmax[SIZE];
+    for(size_t i = 0; i < SIZE; i++) {
+        Float nan = std::numeric_limits<Float>::quiet_NaN();
+        ox[i] = oy[i] = oz[i] = ix[i] = iy[i] = iz[i] = tmax[i] = nan;
+    }
+
+    Hit nearest[SIZE];
+    simd::BlockHit block_hits[SIZE];
+
+    for(size_t i = 0; i < packet.count; i++) {
+        const Ray& ray = packet.rays[i];
+
+        for(auto& shape : fallback) {
+            Hit current = shape->hit(ray, nearest[i].dist);
+            if(current.shape) {
+                nearest[i] = current;
+            }
+        }
+
+        block_hits[i] = { .dist = nearest[i].dist };
+        simd::intersect(plane_blocks.data(), plane_blocks.size(), simd::RayLanes { ray }, block_hits[i]);
+
+        ox[i] = ray.pos.x;
+        oy[i] = ray.pos.y;
+        oz[i] = ray.pos.z;
+        ix[i] = 1.0 / ray.dir.x;
+        iy[i] = 1.0 / ray.dir.y;
+        iz[i] = 1.0 / ray.dir.z;
+        tmax[i] = block_hits[i].dist;
+    }
+
+    // Slab test of every ray against one box, bit i set if ray i hits
+    auto hit_mask = [&](const Bounds3f& bounds) {
+        u32 mask = 0;
+        for(size_t g = 0; g < GROUPS; g++) {
+            size_t k = g * simd::WIDTH;
+            F64x4 t0, t1;
+            F64x4 tnear = F64x4::splat(0.0);
+            F64x4 tfar  = F64x4::load(tmax + k);
+
+            F64x4 axes[3][3] = {
+                { F64x4::splat(bounds.min.x), F64x4::splat(bounds.max.x), F64x4::load(ox + k) },
+                { F64x4::splat(bounds.min.y), F64x4::splat(bounds.max.y), F64x4::load(oy + k) },
+                { F64x4::splat(bounds.min.z), F64x4::splat(bounds.max.z), F64x4::load(oz + k) },
+            };
+            const Float* inv[3] = { ix + k, iy + k, iz + k };
+
+            for(size_t a = 0; a < 3; a++) {
+                F64x4 inv_dir = F64x4::load(inv[a]);
+                t0 = (axes[a][0] - axes[a][2]) * inv_dir;
+                t1 = (axes[a][1] - axes[a][2]) * inv_dir;
+
+                // Rays in a slab plane give 0 * inf = NaN, which min and max pass on or drop
+                // by operand order. Bounds3::hit ignores them, so they become the open side
+                t0 = simd::select(t0 >= t0, t0, F64x4::splat(-INFINITY));
+                t1 = simd::select(t1 >= t1, t1, F64x4::splat(INFINITY));
+                tnear = simd::max(simd::min(t0, t1), tnear);
+                tfar  = simd::min(simd::max(t0, t1), tfar);
+            }
+            mask |= simd::bits(tnear <= tfar) << k;
+        }
+        return mask;
+    };
+
+    if(!tree.nodes.empty()) {
+        bool negative[3] = { ix[0] < 0.0, iy[0] < 0.0, iz[0] < 0.0 };
+
+        u32 stack[128];
+        size_t top = 0;
+        stack[top++] = 0;
+
+        while(top > 0) {
+            const BVHTree::Node& node = tree.nodes[stack[--top]];
+            u32 mask = hit_mask(node.bounds);
+            if(mask == 0) continue;
+
+            if(node.count > 0) {
+                for(; mask != 0; mask &= mask - 1) {
+                    size_t i = static_cast<size_t>(std::countr_zero(mask));
+                    intersect_leaf(leaves[node.offset], simd::RayLanes { packet.rays[i] }, block_hits[i]);
+                    tmax[i] = block_hits[i].dist;
+                }
+                continue;
+            }
+
+            // Children ordered by the direction of the first ray
+            u32 near = static_cast<u32>(&node - tree.nodes.data()) + 1;
+            u32 far  = node.offset;
+            if(negative[node.axis]) std::swap(near, far);
+
+            stack[top++] = far;
+            stack[top++] = near;
+        }
+    }
+
+    // Surfaces only for the nearest hit of each ray
+    for(size_t i = 0; i < packet.count; i++) {
+        if(block_hits[i].hit) {
+            nearest[i] = { .dist = block_hits[i].dist, .shape = this, .prim = block_hits[i].prim };
+        }
+        if(!nearest[i].shape) {
+            hits[i] = { .hit = false };
+            continue;
+        }
+        hits[i] = {
+            .local = nearest[i].shape->surface_at(packet.rays[i], nearest[i]),
+            .dist  = nearest[i].dist,
+            .hit   = true
+        };
+    }
+}
+
+Bounds3f BakedScene::bounds() const {
+    if(!planes.empty()) return Bounds3f::infinite();
+
+    Bounds3f out = tree.nodes.empty() ? Bounds3f::empty() : tree.nodes[0].bounds;
+    for(auto& shape : fallback) {
+        out = out.merge(shape->bounds());
+    }
+    return out;
+}
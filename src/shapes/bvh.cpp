@@ -0,0 +1,522 @@
+#include "core.hpp"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <thread>
+
+namespace {
+    constexpr Float COST_TRAVERSE = 1.0;
+
+    // Past this depth splits fall back to the median, bounding traversal stack use
+    constexpr size_t MAX_SAH_DEPTH = 64;
+
+    constexpr size_t BIN_COUNT = 16;
+
+    // Subtrees smaller than this are built on the current thread
+    constexpr size_t PARALLEL_MIN_PRIMS = 4096;
+
+    struct BuildPrim {
+        Bounds3f bounds;
+        Vec3f centroid;
+        u32 index;
+        u32 code;
+    };
+
+    /// Runs fn(0) .. fn(count - 1) on separate threads
+    template<typename Fn>
+    void run_parallel(size_t count, Fn fn) {
+        std::vector<std::thread> threads;
+        for(size_t i = 1; i < count; i++) {
+            threads.emplace_back(fn, i);
+        }
+        fn(0);
+        for(auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    /// Sorts chunks on separate threads, then merges them pairwise
+    template<typename T, typename Cmp>
+    void parallel_sort(std::vector<T>& data, Cmp cmp, size_t threads) {
+        size_t chunks = std::clamp<size_t>(data.size() / PARALLEL_MIN_PRIMS, 1, threads);
+
+        std::vector<size_t> split(chunks + 1);
+        for(size_t i = 0; i <= chunks; i++) {
+            split[i] = data.size() * i / chunks;
+        }
+
+        auto begin = data.begin();
+        run_parallel(chunks, [&](size_t i) {
+            std::sort(begin + split[i], begin + split[i + 1], cmp);
+        });
+
+        for(size_t width = 1; width < chunks; width *= 2) {
+            size_t merges = (chunks + 2 * width - 1) / (2 * width);
+            run_parallel(merges, [&](size_t k) {
+                size_t i = 2 * width * k;
+                if(i + width >= chunks) return;
+
+                std::inplace_merge(
+                    begin + split[i],
+                    begin + split[i + width],
+                    begin + split[std::min(i + 2 * width, chunks)],
+                    cmp
+                );
+            });
+        }
+    }
+
+    /// Spreads the low 10 bits of x so they occupy every third bit
+    u32 expand_bits(u32 x) {
+        x = (x * 0x00010001u) & 0xFF0000FFu;
+        x = (x * 0x00000101u) & 0x0F00F00Fu;
+        x = (x * 0x00000011u) & 0xC30C30C3u;
+        x = (x * 0x00000005u) & 0x49249249u;
+        return x;
+    }
+    u32 morton_code(Vec3f unit) {
+        auto quantize = [](Float v) {
+            return static_cast<u32>(std::clamp(v * 1024.0, 0.0, 1023.0));
+        };
+        return (expand_bits(quantize(unit.x)) << 2)
+             | (expand_bits(quantize(unit.y)) << 1)
+             |  expand_bits(quantize(unit.z));
+    }
+
+    struct Builder {
+        using Node = BVHTree::Node;
+
+        std::vector<BuildPrim>& prims;
+        BVHOptions options;
+
+        void sort_axis(size_t begin, size_t end, size_t axis) {
+            std::sort(
+                prims.begin() + begin, prims.begin() + end,
+                [axis](const BuildPrim& a, const BuildPrim& b) {
+                    return a.centroid.unsafe_get(axis) < b.centroid.unsafe_get(axis);
+                }
+            );
+        }
+        Bounds3f centroid_bounds(size_t begin, size_t end) const {
+            Bounds3f out;
+            for(size_t i = begin; i < end; i++) {
+                out = out.merge(prims[i].centroid);
+            }
+            return out;
+        }
+
+        bool split_median(size_t begin, size_t end, size_t& mid, u16& axis) {
+            size_t count = end - begin;
+            if(count <= options.max_leaf) return false;
+
+            size_t a = centroid_bounds(begin, end).max_axis();
+            axis = static_cast<u16>(a);
+            mid  = begin + count / 2;
+            std::nth_element(
+                prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                [a](const BuildPrim& lhs, const BuildPrim& rhs) {
+                    return lhs.centroid.unsafe_get(a) < rhs.centroid.unsafe_get(a);
+                }
+            );
+            return true;
+        }
+
+        /// Full SAH sweep over sorted centroids on each axis
+        bool split_sweep(size_t begin, size_t end, size_t& mid, u16& axis) {
+            size_t count = end - begin;
+
+            Bounds3f bounds;
+            for(size_t i = begin; i < end; i++) {
+                bounds = bounds.merge(prims[i].bounds);
+            }
+            Float parent_area = bounds.surface_area();
+            if(parent_area <= 0.0) {
+                return split_median(begin, end, mid, axis);
+            }
+
+            Float best_cost  = INFINITY;
+            size_t best_axis = 0;
+
+            std::vector<Float> right_area(count);
+            for(size_t a = 0; a < 3; a++) {
+                sort_axis(begin, end, a);
+
+                Bounds3f right;
+                for(size_t i = count - 1; i > 0; i--) {
+                    right = right.merge(prims[begin + i].bounds);
+                    right_area[i] = right.surface_area();
+                }
+
+                Bounds3f left;
+                for(size_t i = 1; i < count; i++) {
+                    left = left.merge(prims[begin + i - 1].bounds);
+
+                    Float cost = COST_TRAVERSE + options.intersect_cost * (
+                        left.surface_area() * i + right_area[i] * (count - i)
+                    ) / parent_area;
+
+                    if(cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = a;
+                        mid = begin + i;
+                    }
+                }
+            }
+
+            if(count <= options.max_leaf && options.intersect_cost * count <= best_cost) {
+                return false;
+            }
+
+            // Last sweep left the primitives sorted along z
+            if(best_axis != 2) {
+                sort_axis(begin, end, best_axis);
+            }
+            axis = static_cast<u16>(best_axis);
+            return true;
+        }
+
+        /// SAH evaluated at bin boundaries of the centroid bounds
+        bool split_binned(size_t begin, size_t end, size_t& mid, u16& axis) {
+            size_t count = end - begin;
+
+            Bounds3f centroids = centroid_bounds(begin, end);
+            Vec3f extent = centroids.extent();
+
+            struct Bin {
+                Bounds3f bounds;
+                size_t count = 0;
+            };
+            auto bin_of = [&](const BuildPrim& prim, size_t a) {
+                Float rel = (prim.centroid.unsafe_get(a) - centroids.min.unsafe_get(a)) / extent.unsafe_get(a);
+                return std::min(static_cast<size_t>(rel * BIN_COUNT), BIN_COUNT - 1);
+            };
+
+            Bounds3f bounds;
+            Float best_cost  = INFINITY;
+            size_t best_axis = 0;
+            size_t best_bin  = 0;
+
+            for(size_t a = 0; a < 3; a++) {
+                if(extent.unsafe_get(a) <= 0.0) continue;
+
+                Bin bins[BIN_COUNT];
+                for(size_t i = begin; i < end; i++) {
+                    Bin& bin = bins[bin_of(prims[i], a)];
+                    bin.bounds = bin.bounds.merge(prims[i].bounds);
+                    bin.count++;
+                }
+
+                Float right_area[BIN_COUNT];
+                size_t right_count[BIN_COUNT];
+                Bounds3f right;
+                size_t n = 0;
+                for(size_t b = BIN_COUNT - 1; b > 0; b--) {
+                    right = right.merge(bins[b].bounds);
+                    n += bins[b].count;
+                    right_area[b]  = right.surface_area();
+                    right_count[b] = n;
+                }
+                bounds = right.merge(bins[0].bounds);
+
+                Bounds3f left;
+                n = 0;
+                for(size_t b = 1; b < BIN_COUNT; b++) {
+                    left = left.merge(bins[b - 1].bounds);
+                    n += bins[b - 1].count;
+
+                    Float cost = left.surface_area() * n + right_area[b] * right_count[b];
+                    if(cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = a;
+                        best_bin  = b;
+                    }
+                }
+            }
+
+            // All centroids coincide
+            if(best_cost == INFINITY) {
+                return split_median(begin, end, mid, axis);
+            }
+
+            Float parent_area = bounds.surface_area();
+            best_cost = COST_TRAVERSE + options.intersect_cost * best_cost / parent_area;
+            if(count <= options.max_leaf && options.intersect_cost * count <= best_cost) {
+                return false;
+            }
+
+            auto pivot = std::partition(
+                prims.begin() + begin, prims.begin() + end,
+                [&](const BuildPrim& prim) { return bin_of(prim, best_axis) < best_bin; }
+            );
+            mid  = static_cast<size_t>(pivot - prims.begin());
+            axis = static_cast<u16>(best_axis);
+
+            if(mid == begin || mid == end) {
+                return split_median(begin, end, mid, axis);
+            }
+            return true;
+        }
+
+        /// Splits sorted Morton codes at their highest differing bit
+        bool split_morton(size_t begin, size_t end, size_t& mid, u16& axis) {
+            size_t count = end - begin;
+            if(count <= options.max_leaf) return false;
+
+            u32 first = prims[begin].code;
+            u32 last  = prims[end - 1].code;
+            if(first == last) {
+                mid  = begin + count / 2;
+                axis = 0;
+                return true;
+            }
+
+            u32 bit = 31 - static_cast<u32>(std::countl_zero(first ^ last));
+            auto pivot = std::partition_point(
+                prims.begin() + begin, prims.begin() + end,
+                [bit](const BuildPrim& prim) { return ((prim.code >> bit) & 1) == 0; }
+            );
+            mid  = static_cast<size_t>(pivot - prims.begin());
+            axis = static_cast<u16>(2 - bit % 3);
+            return true;
+        }
+
+        bool split(size_t begin, size_t end, size_t depth, size_t& mid, u16& axis) {
+            if(end - begin == 1) return false;
+            if(depth >= MAX_SAH_DEPTH) return split_median(begin, end, mid, axis);
+
+            switch(options.method) {
+                case BVHBuild::Sweep:  return split_sweep(begin, end, mid, axis);
+                case BVHBuild::Binned: return split_binned(begin, end, mid, axis);
+                case BVHBuild::Morton: return split_morton(begin, end, mid, axis);
+            }
+            return false;
+        }
+
+        /// Appends the subtree over [begin, end) to `out`, with its root first
+        void build(std::vector<Node>& out, size_t begin, size_t end, size_t depth) {
+            u32 node = static_cast<u32>(out.size());
+            out.push_back({});
+
+            size_t mid;
+            u16 axis;
+            if(!split(begin, end, depth, mid, axis)) {
+                Bounds3f bounds;
+                for(size_t i = begin; i < end; i++) {
+                    bounds = bounds.merge(prims[i].bounds);
+                }
+                out[node] = { bounds, static_cast<u32>(begin), static_cast<u16>(end - begin), 0 };
+                return;
+            }
+
+            build(out, begin, mid, depth + 1);
+            u32 second = static_cast<u32>(out.size());
+            build(out, mid, end, depth + 1);
+
+            out[node] = { out[node + 1].bounds.merge(out[second].bounds), second, 0, axis };
+        }
+
+        /// Builds the two halves of each split on separate threads while
+        /// threads remain, splicing the child subtrees after their parent
+        std::vector<Node> build_parallel(size_t begin, size_t end, size_t depth, size_t threads) {
+            std::vector<Node> out;
+
+            size_t mid;
+            u16 axis;
+            if(threads <= 1 || end - begin < PARALLEL_MIN_PRIMS || !split(begin, end, depth, mid, axis)) {
+                out.reserve(2 * (end - begin) / options.max_leaf + 1);
+                build(out, begin, end, depth);
+                return out;
+            }
+
+            size_t left_threads = threads / 2;
+            std::vector<Node> left;
+            std::thread worker([&] {
+                left = build_parallel(begin, mid, depth + 1, left_threads);
+            });
+            std::vector<Node> right = build_parallel(mid, end, depth + 1, threads - left_threads);
+            worker.join();
+
+            u32 second = static_cast<u32>(1 + left.size());
+            out.reserve(second + right.size());
+            out.push_back({ left[0].bounds.merge(right[0].bounds), second, 0, axis });
+
+            for(auto [subtree, base] : { std::pair { &left, 1u }, std::pair { &right, second } }) {
+                for(Node node : *subtree) {
+                    if(node.count == 0) node.offset += base;
+                    out.push_back(node);
+                }
+            }
+            return out;
+        }
+    };
+
+    BVHStats compute_stats(const std::vector<BVHTree::Node>& nodes, const BVHOptions& options) {
+        BVHStats stats;
+        stats.nodes = nodes.size();
+        if(nodes.empty()) return stats;
+
+        Float root_area = nodes[0].bounds.surface_area();
+        size_t prims = 0;
+
+        std::vector<std::pair<u32, size_t>> stack = { { 0, 1 } };
+        while(!stack.empty()) {
+            auto [index, depth] = stack.back();
+            stack.pop_back();
+
+            const BVHTree::Node& node = nodes[index];
+            Float area = node.bounds.surface_area();
+            stats.depth = std::max(stats.depth, depth);
+
+            if(node.count == 0) {
+                stats.sah_cost += COST_TRAVERSE * area;
+                stack.push_back({ index + 1, depth + 1 });
+                stack.push_back({ node.offset, depth + 1 });
+            }
+            else {
+                stats.sah_cost += options.intersect_cost * area * node.count;
+                stats.leaves++;
+                stats.max_leaf_size = std::max<size_t>(stats.max_leaf_size, node.count);
+                prims += node.count;
+            }
+        }
+
+        if(root_area > 0.0) stats.sah_cost /= root_area;
+        stats.mean_leaf_size = static_cast<Float>(prims) / stats.leaves;
+        return stats;
+    }
+}
+
+void BVHTree::build(const std::vector<Bounds3f>& bounds, BVHOptions options) {
+    auto start = std::chrono::steady_clock::now();
+
+    nodes.clear();
+    order.clear();
+    stats = {};
+    if(bounds.empty()) return;
+
+    size_t threads = options.threads;
+    if(threads == 0) {
+        threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    options.max_leaf = std::clamp<size_t>(options.max_leaf, 1, 255);
+
+    std::vector<BuildPrim> prims(bounds.size());
+    size_t chunks = std::clamp<size_t>(prims.size() / PARALLEL_MIN_PRIMS, 1, threads);
+    run_parallel(chunks, [&](size_t k) {
+        for(size_t i = prims.size() * k / chunks; i < prims.size() * (k + 1) / chunks; i++) {
+            prims[i] = { bounds[i], bounds[i].centroid(), static_cast<u32>(i), 0 };
+        }
+    });
+
+    if(options.method == BVHBuild::Morton) {
+        Bounds3f centroids;
+        for(auto& prim : prims) {
+            centroids = centroids.merge(prim.centroid);
+        }
+        Vec3f extent = centroids.extent();
+        Vec3f scale = {
+            extent.x > 0.0 ? 1.0 / extent.x : 0.0,
+            extent.y > 0.0 ? 1.0 / extent.y : 0.0,
+            extent.z > 0.0 ? 1.0 / extent.z : 0.0
+        };
+
+        run_parallel(chunks, [&](size_t k) {
+            for(size_t i = prims.size() * k / chunks; i < prims.size() * (k + 1) / chunks; i++) {
+                prims[i].code = morton_code((prims[i].centroid - centroids.min) * scale);
+            }
+        });
+        parallel_sort(prims, [](const BuildPrim& a, const BuildPrim& b) {
+            return a.code < b.code;
+        }, threads);
+    }
+
+    Builder builder { prims, options };
+    nodes = builder.build_parallel(0, prims.size(), 0, threads);
+
+    order.reserve(prims.size());
+    for(auto& prim : prims) {
+        order.push_back(prim.index);
+    }
+
+    std::chrono::duration<Float> elapsed = std::chrono::steady_clock::now() - start;
+    stats = compute_stats(nodes, options);
+    stats.build_seconds = elapsed.count();
+}
+
+
+BVH::BVH(const ShapeList& list, BVHOptions options) {
+    std::vector<std::shared_ptr<Shape>> shapes;
+    std::vector<Bounds3f> bounds;
+
+    for(auto& shape : list.data) {
+        Bounds3f b = shape->bounds();
+        if(b.is_finite()) {
+            shapes.push_back(shape);
+            bounds.push_back(b);
+        }
+        else {
+            unbounded.push_back(shape);
+        }
+    }
+
+    tree.build(bounds, options);
+
+    // Store shapes in leaf order so each leaf is a contiguous range
+    bounded.reserve(shapes.size());
+    for(u32 index : tree.order) {
+        bounded.push_back(shapes[index]);
+    }
+}
+
+void BVH::format(std::ostream& out, size_t indent) const {
+    write_indent(out, indent);
+    out << "BVH(bounded: " << bounded.size()
+        << ", unbounded: " << unbounded.size()
+        << ", " << tree.stats << ")";
+}
+
+Hit BVH::hit(const Ray& ray, Float tmax) const {
+    Hit nearest = { .dist = tmax };
+
+    // Unbounded shapes first, their hits tighten the traversal distance
+    for(auto& shape : unbounded) {
+        Hit current = shape->hit(ray, nearest.dist);
+        if(current.shape) {
+            nearest = current;
+        }
+    }
+
+    tree.traverse(ray, nearest.dist, [&](u32 offset, u32 count) {
+        for(u32 i = offset; i < offset + count; i++) {
+            Hit current = bounded[i]->hit(ray, nearest.dist);
+            if(current.shape) {
+                nearest = current;
+            }
+        }
+        return false;
+    });
+    return nearest;
+}
+
+bool BVH::occluded(const Ray& ray, Float tmax) const {
+    for(auto& shape : unbounded) {
+        if(shape->occluded(ray, tmax)) return true;
+    }
+
+    bool found = false;
+    tree.traverse(ray, tmax, [&](u32 offset, u32 count) {
+        for(u32 i = offset; i < offset + count && !found; i++) {
+            found = bounded[i]->occluded(ray, tmax);
+        }
+        return found;
+    });
+    return found;
+}
+
+Bounds3f BVH::bounds() const {
+    Bounds3f out = tree.nodes.empty() ? Bounds3f::empty() : tree.nodes[0].bounds;
+    for(auto& shape : unbounded) {
+        out = out.merge(shape->bounds());
+    }
+    return out;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "../core.hpp"
+#include "simd.hpp"
 
 struct Plane : public Shape {
     Material m_material; 
@@ -17,7 +18,9 @@ struct Plane : public Shape {
 
     void format(std::ostream& out, size_t indent) const override;
 
-    Intersection intersect(Ray ray) const override;
+    Hit hit(const Ray& ray, Float tmax) const override;
+    LocalSurface surface_at(const Ray& ray, const Hit& hit) const override;
+    Bounds3f bounds() const override;
 };
 
 struct Disc : public Shape {
@@ -40,7 +43,11 @@ struct Disc : public Shape {
 
     void format(std::ostream& out, size_t indent) const override;
 
-    Intersection intersect(Ray ray) const override;
+    Hit hit(const Ray& ray, Float tmax) const override;
+    LocalSurface surface_at(const Ray& ray, const Hit& hit) const override;
+    SurfaceSample sample_point(Vec2f u) const override;
+    Float pdf(Vec3f pos) const override;
+    Bounds3f bounds() const override;
 };
 
 struct Diamond : public Shape {
@@ -63,7 +70,15 @@ struct Diamond : public Shape {
     }
 
     void format(std::ostream& out, size_t indent) const override;
-    Intersection intersect(Ray ray) const override;
+    Hit hit(const Ray& ray, Float tmax) const override;
+    LocalSurface surface_at(const Ray& ray, const Hit& hit) const override;
+    SurfaceSample sample_point(Vec2f u) const override;
+    Float pdf(Vec3f pos) const override;
+    Bounds3f bounds() const override;
+
+private:
+    /// Half diagonals of the region hit tests accept, pos + s * p + t * q for |s|, |t| <= 1
+    std::pair<Vec3f, Vec3f> axes() const;
 };
 
 
@@ -82,7 +97,11 @@ struct Sphere : public Shape {
     }
 
     void format(std::ostream& out, size_t indent) const override;
-    Intersection intersect(Ray ray) const override;
+    Hit hit(const Ray& ray, Float tmax) const override;
+    LocalSurface surface_at(const Ray& ray, const Hit& hit) const override;
+    SurfaceSample sample_point(Vec2f u) const override;
+    Float pdf(Vec3f pos) const override;
+    Bounds3f bounds() const override;
 };
 
 struct ShapeList : public Shape {
@@ -93,5 +112,192 @@ struct ShapeList : public Shape {
         data.push_back(shape);
     }
 
-    Intersection intersect(Ray ray) const override;
-};
\ No newline at end of file
+    Hit hit(const Ray& ray, Float tmax) const override;
+    bool occluded(const Ray& ray, Float tmax) const override;
+    Bounds3f bounds() const override;
+};
+
+/// The scene main renders: a box of [-1, 1]^3 with red and green side walls and a
+/// glossy back wall, a sphere, and a ceiling light that is also added to `lights`
+ShapeList cornell_box(std::vector<const Shape*>& lights);
+
+
+enum class BVHBuild {
+    Sweep,   // Full SAH sweep over sorted centroids, best quality, slowest
+    Binned,  // Binned SAH, near sweep quality
+    Morton   // Linear BVH from sorted Morton codes, fastest
+};
+
+struct BVHOptions {
+    BVHBuild method = BVHBuild::Binned;
+    size_t max_leaf = 4;
+    size_t threads  = 0; // 0: hardware concurrency
+
+    // Cost of one primitive test relative to a node traversal step,
+    // lower values give larger leaves
+    Float intersect_cost = 1.0;
+};
+
+struct BVHStats {
+    Float build_seconds = 0.0;
+    Float sah_cost = 0.0;
+    size_t depth = 0;
+    size_t nodes = 0;
+    size_t leaves = 0;
+    size_t max_leaf_size = 0;
+    Float mean_leaf_size = 0.0;
+
+    friend std::ostream& operator<<(std::ostream& out, const BVHStats& stats) {
+        return out << "BVHStats(build: " << 1000.0 * stats.build_seconds << "ms"
+            << ", sah: "   << stats.sah_cost
+            << ", depth: " << stats.depth
+            << ", nodes: " << stats.nodes
+            << ", leaves: " << stats.leaves
+            << ", leaf size: " << stats.mean_leaf_size << " avg " << stats.max_leaf_size << " max)";
+    }
+};
+
+/// Bounding volume hierarchy over a list of primitive bounds
+/// Leaves refer to the range [offset, offset + count) of `order`
+struct BVHTree {
+    struct Node {
+        Bounds3f bounds;
+        u32 offset;  // Leaf: first primitive, Interior: second child
+        u16 count;   // Leaf: primitive count, Interior: 0
+        u16 axis;    // Interior: split axis
+    };
+
+    std::vector<Node> nodes;
+    std::vector<u32>  order;
+    BVHStats stats;
+
+    /// Builds subtrees in parallel once enough primitives are split off
+    void build(const std::vector<Bounds3f>& prims, BVHOptions options = {});
+
+    /// Visits leaves in front to back order, pruning nodes beyond `tmax`
+    /// `leaf(offset, count)` may shrink `tmax`, returning true stops traversal
+    template<typename Fn>
+    void traverse(const Ray& ray, const Float& tmax, Fn leaf) const {
+        if(nodes.empty()) return;
+
+        Vec3f inv_dir = { 1.0 / ray.dir.x, 1.0 / ray.dir.y, 1.0 / ray.dir.z };
+        bool negative[3] = { inv_dir.x < 0.0, inv_dir.y < 0.0, inv_dir.z < 0.0 };
+
+        u32 stack[128];
+        size_t top = 0;
+        stack[top++] = 0;
+
+        while(top > 0) {
+            const Node& node = nodes[stack[--top]];
+            if(!node.bounds.hit(ray.pos, inv_dir, tmax)) continue;
+
+            if(node.count > 0) {
+                if(leaf(node.offset, node.count)) return;
+                continue;
+            }
+
+            u32 near = static_cast<u32>(&node - nodes.data()) + 1;
+            u32 far  = node.offset;
+            if(negative[node.axis]) std::swap(near, far);
+
+            stack[top++] = far;
+            stack[top++] = near;
+        }
+    }
+};
+
+/// Acceleration structure over the shapes of a ShapeList
+/// Unbounded shapes (infinite planes) are tested linearly
+struct BVH : public Shape {
+    BVHTree tree;
+    std::vector<std::shared_ptr<Shape>> bounded;
+    std::vector<std::shared_ptr<Shape>> unbounded;
+
+    BVH(const ShapeList& list, BVHOptions options = {});
+
+    void format(std::ostream& out, size_t indent) const override;
+    Hit hit(const Ray& ray, Float tmax) const override;
+    bool occluded(const Ray& ray, Float tmax) const override;
+    Bounds3f bounds() const override;
+};
+
+/// Frozen form of a ShapeList, one contiguous array per primitive type
+/// Primitives refer to a shared material table instead of holding a copy,
+/// and constants that Shape::hit recomputes are precomputed here
+struct BakedScene : public Shape {
+    struct BakedPlane {
+        Vec3f pos;
+        Unit<Vec3f> dir;
+        u32 material;
+    };
+    struct BakedSphere {
+        Vec3f pos;
+        Float radius2;
+        u32 material;
+    };
+    struct BakedDisc {
+        Vec3f pos;
+        Unit<Vec3f> dir;
+        Float radius2;
+        u32 material;
+    };
+    struct BakedDiamond {
+        Vec3f pos;
+        Unit<Vec3f> dir;
+        Unit<Vec3f> a_dir;
+        Unit<Vec3f> b_dir;
+        Float a_norm;
+        Float b_norm;
+        u32 material;
+    };
+
+    /// Per type block ranges of a BVH leaf
+    struct Leaf {
+        u32 sphere_begin, sphere_end;
+        u32 disc_begin, disc_end;
+        u32 diamond_begin, diamond_end;
+    };
+
+    /// Block lanes refer to primitives by kind and index
+    enum Kind : u32 { PLANE, SPHERE, DISC, DIAMOND };
+    static constexpr u32 KIND_SHIFT = 28;
+
+    std::vector<Material> materials;
+
+    std::vector<BakedPlane>   planes;
+    std::vector<BakedSphere>  spheres;
+    std::vector<BakedDisc>    discs;
+    std::vector<BakedDiamond> diamonds;
+
+    std::vector<simd::DiscBlock>    plane_blocks;
+    std::vector<simd::SphereBlock>  sphere_blocks;
+    std::vector<simd::DiscBlock>    disc_blocks;
+    std::vector<simd::DiamondBlock> diamond_blocks;
+
+    /// Leaf nodes of `tree` store an index into `leaves` as their offset
+    BVHTree tree;
+    std::vector<Leaf> leaves;
+
+    /// Shapes of unknown type, tested through the virtual interface
+    std::vector<std::shared_ptr<Shape>> fallback;
+
+    BakedScene(const ShapeList& list, BVHOptions options = {});
+
+    // Surfaces point into `materials`
+    BakedScene(const BakedScene&) = delete;
+    BakedScene& operator=(const BakedScene&) = delete;
+
+    void format(std::ostream& out, size_t indent) const override;
+    /// Block hits refer to primitives by `prim`, fallback hits by their own shape
+    Hit hit(const Ray& ray, Float tmax) const override;
+    LocalSurface surface_at(const Ray& ray, const Hit& hit) const override;
+    bool occluded(const Ray& ray, Float tmax) const override;
+    Bounds3f bounds() const override;
+
+    /// Traverses the BVH once for the whole packet, descending into nodes
+    /// hit by any ray and testing leaves only against the rays that hit them
+    void intersect_packet(const RayPacket& packet, Intersection* hits) const override;
+
+private:
+    void intersect_leaf(const Leaf& leaf, const simd::RayLanes& ray, simd::BlockHit& hit) const;
+};
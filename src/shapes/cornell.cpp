@@ -0,0 +1,52 @@
+#include "core.hpp"
+
+ShapeList cornell_box(std::vector<const Shape*>& lights) {
+    ShapeList scene;
+
+    scene.add(
+        Sphere {}
+            .with_pos({ -0.3, -0.6, 0.50 })
+            .with_radius(0.4)
+            .with_material({ .diffuse = 0.7 * Colors::WHITE })
+            .build()
+    );
+
+    std::pair<Vec3f, Material> planes[] = {
+        { {-1.0, 0.0, 0.0 }, Material { .diffuse = 0.95 * Colors::RED   } },
+        { {+1.0, 0.0, 0.0 }, Material { .diffuse = 0.95 * Colors::GREEN } },
+        { { 0.0,-1.0, 0.0 }, Material { .diffuse = 0.95 * Colors::WHITE } },
+        { { 0.0,+1.0, 0.0 }, Material { .diffuse = 0.95 * Colors::WHITE } },
+        {
+            { 0.0, 0.0,-1.0 },
+            Material {
+                .diffuse = 0.7 * Colors::WHITE,
+                .specular = 0.8 * Colors::WHITE,
+                .prob_specular = 0.7
+            }
+        },
+        { { 0.0, 0.0,+1.0 }, Material { .diffuse = 0.8 * Colors::WHITE } },
+    };
+    for (auto [pos, material] : planes) {
+        scene.add(
+            Plane{}
+                .with_pos(pos)
+                .with_dir(-pos)
+                .with_material(material)
+                .build()
+        );
+    }
+
+    std::shared_ptr<Shape> bulb = Diamond{}
+        .with_pos({ 0.0, 0.99, 0.0 })
+        .with_a({ 0.25, 0.0, 0.0 })
+        .with_b({ 0.0, 0.0, 0.25 })
+        .with_material({
+            .emission = Color { 10.0, 10.0, 10.0 }
+        })
+        .build();
+
+    // Lights are sampled through the built shape, which has its normal set
+    scene.add(bulb);
+    lights.push_back(bulb.get());
+    return scene;
+}
@@ -22,37 +22,82 @@ void Diamond::format(std::ostream& out, size_t indent) const {
     out << "Diamond(a: " << m_a << ", b: " << m_b << ")";
 }
 
-Intersection Diamond::intersect(Ray ray) const {    
+Hit Diamond::hit(const Ray& ray, Float tmax) const {    
+    telemetry::count(telemetry::PrimitiveTests);
 
     // Component of ray along plane normal
     Float ray_n = m_dir.dot(ray.dir);
 
     // Parallel to plane
-    if(ray_n == 0.0) return { .hit = false };
+    if(ray_n == 0.0) return {};
 
     Float t = m_dir.dot(m_pos - ray.pos) / ray_n;
-    if(t <= 0.0) return { .hit = false };
+    if(t <= 0.0 || t >= tmax) return {};
 
     Vec3f pos = ray.pos + ray.dir * t;
 
     Float mA = m_a.norm();
     Float mB = m_b.norm();
 
-    Float a_comp = std::abs(m_a.dot(pos) / mA);
-    Float b_comp = std::abs(m_b.dot(pos) / mB);
+    Vec3f rel = pos - m_pos;
+    Float a_comp = std::abs(m_a.dot(rel) / mA);
+    Float b_comp = std::abs(m_b.dot(rel) / mB);
 
     // Outside diamond
     if(a_comp > mA || b_comp > mB) {
-        return { .hit = false };
+        return {};
     }
 
-    return Intersection {
+    return { .dist = t, .shape = this };
+}
+
+LocalSurface Diamond::surface_at(const Ray& ray, const Hit& hit) const {
+    return {
+        .pos      = ray.pos + ray.dir * hit.dist,
+        .normal   = (m_dir.dot(ray.dir) > 0.0) ? -m_dir : m_dir,
+        .material = &m_material,
+    };
+}
+
+std::pair<Vec3f, Vec3f> Diamond::axes() const {
+    // Corners satisfy a.rel = +-|a|^2 and b.rel = +-|b|^2 for rel = s * a + t * b,
+    // which reduce to a + b, a - b, ... only when a and b are perpendicular
+    Float aa = m_a.dot(m_a);
+    Float ab = m_a.dot(m_b);
+    Float bb = m_b.dot(m_b);
+    Float det = aa * bb - ab * ab;
+
+    return {
+        (aa * bb * m_a - aa * ab * m_b) / det,
+        (aa * bb * m_b - bb * ab * m_a) / det
+    };
+}
+
+SurfaceSample Diamond::sample_point(Vec2f u) const {
+    auto [p, q] = axes();
+    return {
         .local = {
-            .pos      = pos,
-            .normal   = (ray_n > 0.0) ? -m_dir : m_dir,
-            .material = &m_material,
+            .pos      = m_pos + (2.0 * u.x - 1.0) * p + (2.0 * u.y - 1.0) * q,
+            .normal   = m_dir,
+            .material = &m_material
         },
-        .dist = t,
-        .hit = true
+        .pdf = pdf(m_pos)
     };
-}
\ No newline at end of file
+}
+
+Float Diamond::pdf(Vec3f pos) const {
+    auto [p, q] = axes();
+    return 1.0 / (4.0 * p.cross(q).norm());
+}
+
+Bounds3f Diamond::bounds() const {
+    auto [p, q] = axes();
+
+    Bounds3f out;
+    for(Float sa : { -1.0, 1.0 }) {
+        for(Float sb : { -1.0, 1.0 }) {
+            out = out.merge(m_pos + sa * p + sb * q);
+        }
+    }
+    return out;
+}
@@ -22,35 +22,67 @@ void Disc::format(std::ostream& out, size_t indent) const {
     out << "Disc(pos: " << m_pos << ", dir: " << m_dir << ")";
 }
 
-Intersection Disc::intersect(Ray ray) const {    
+Hit Disc::hit(const Ray& ray, Float tmax) const {    
+    telemetry::count(telemetry::PrimitiveTests);
     // Component of ray along Disc normal
     Float ray_n = m_dir.dot(ray.dir);
 
     // Parallel to Disc
     if(ray_n == 0.0) {
-        return { .hit = false };
+        return {};
     }
 
     // First intersection
     Float t = m_dir.dot(m_pos - ray.pos) / ray_n;
-    if(t <= 0.0) {
-        return { .hit = false };
+    if(t <= 0.0 || t >= tmax) {
+        return {};
     }
 
     Vec3f pos = ray.pos + ray.dir * t;
 
     // Outside circle
     if((pos - m_pos).norm_squared() > m_radius * m_radius) {
-        return { .hit = false };
+        return {};
     }
 
-    return Intersection {
+    return { .dist = t, .shape = this };
+}
+
+LocalSurface Disc::surface_at(const Ray& ray, const Hit& hit) const {
+    return {
+        .pos      = ray.pos + ray.dir * hit.dist,
+        .normal   = (m_dir.dot(ray.dir) > 0.0) ? -m_dir : m_dir,
+        .material = &m_material,
+    };
+}
+
+SurfaceSample Disc::sample_point(Vec2f u) const {
+    auto [s, t] = tangents(m_dir);
+
+    // sqrt keeps the density uniform in area
+    Float r   = m_radius * std::sqrt(u.x);
+    Float phi = 2 * M_PI * u.y;
+    return {
         .local = {
-            .pos      = pos,
-            .normal   = (ray_n > 0.0) ? -m_dir : m_dir,
-            .material = &m_material,
+            .pos      = m_pos + r * std::cos(phi) * s + r * std::sin(phi) * t,
+            .normal   = m_dir,
+            .material = &m_material
         },
-        .dist = t,
-        .hit = true
+        .pdf = pdf(m_pos)
+    };
+}
+
+Float Disc::pdf(Vec3f pos) const {
+    return 1.0 / (M_PI * m_radius * m_radius);
+}
+
+Bounds3f Disc::bounds() const {
+    // Extent along each axis is radius * sin(angle between axis and normal)
+    Vec3f n2 = m_dir * m_dir;
+    Vec3f extent = {
+        m_radius * std::sqrt(std::max(Float(0), Float(1) - n2.x)),
+        m_radius * std::sqrt(std::max(Float(0), Float(1) - n2.y)),
+        m_radius * std::sqrt(std::max(Float(0), Float(1) - n2.z))
     };
+    return { m_pos - extent, m_pos + extent };
 }
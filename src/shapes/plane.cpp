@@ -18,23 +18,28 @@ void Plane::format(std::ostream& out, size_t indent) const {
     out << "Plane(pos: " << m_pos << ", dir: " << m_dir << ")";
 }
 
-Intersection Plane::intersect(Ray ray) const {    
+Hit Plane::hit(const Ray& ray, Float tmax) const {    
+    telemetry::count(telemetry::PrimitiveTests);
     // Component of ray along plane normal
     Float ray_n = m_dir.dot(ray.dir);
 
     // Parallel to plane
-    if(ray_n == 0.0) return { .hit = false };
+    if(ray_n == 0.0) return {};
 
     Float t = m_dir.dot(m_pos - ray.pos) / ray_n;
-    if(t <= 0.0) return { .hit = false };
-
-    return Intersection {
-        .local = {
-            .pos      = ray.pos + ray.dir * t,
-            .normal   = (ray_n > 0.0) ? -m_dir : m_dir,
-            .material = &m_material,
-        },
-        .dist = t,
-        .hit = true
+    if(t <= 0.0 || t >= tmax) return {};
+
+    return { .dist = t, .shape = this };
+}
+
+LocalSurface Plane::surface_at(const Ray& ray, const Hit& hit) const {
+    return {
+        .pos      = ray.pos + ray.dir * hit.dist,
+        .normal   = (m_dir.dot(ray.dir) > 0.0) ? -m_dir : m_dir,
+        .material = &m_material,
     };
 }
+
+Bounds3f Plane::bounds() const {
+    return Bounds3f::infinite();
+}
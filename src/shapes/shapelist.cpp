@@ -11,13 +11,28 @@ void ShapeList::format(std::ostream& out, size_t indent) const {
     out << "]\n";
 }
 
-Intersection ShapeList::intersect(Ray ray) const {
-    Intersection nearest = { .dist = INFINITY }; 
+Hit ShapeList::hit(const Ray& ray, Float tmax) const {
+    Hit nearest = { .dist = tmax }; 
     for(auto& shape : data) {
-        Intersection current = shape->intersect(ray);
-        if(current.dist < nearest.dist) {
+        Hit current = shape->hit(ray, nearest.dist);
+        if(current.shape) {
             nearest = current;
         }
     }
     return nearest;
 }
+
+bool ShapeList::occluded(const Ray& ray, Float tmax) const {
+    for(auto& shape : data) {
+        if(shape->occluded(ray, tmax)) return true;
+    }
+    return false;
+}
+
+Bounds3f ShapeList::bounds() const {
+    Bounds3f out;
+    for(auto& shape : data) {
+        out = out.merge(shape->bounds());
+    }
+    return out;
+}
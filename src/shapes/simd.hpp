@@ -0,0 +1,329 @@
+#pragma once
+#include "../core.hpp"
+#include <cstddef>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// One ray against four primitives at a time
+/// Primitives are stored as structure of arrays blocks, unused lanes hold NaN
+/// so every comparison on them fails
+namespace simd {
+
+constexpr size_t WIDTH = 4;
+
+#if defined(__AVX__)
+
+struct Mask {
+    __m256d v;
+    friend Mask operator&(Mask a, Mask b) { return { _mm256_and_pd(a.v, b.v) }; }
+};
+struct F64x4 {
+    __m256d v;
+
+    static F64x4 splat(Float x)       { return { _mm256_set1_pd(x) }; }
+    static F64x4 load(const Float* p) { return { _mm256_load_pd(p) }; }
+    void store(Float* p) const        { _mm256_store_pd(p, v); }
+
+    friend F64x4 operator+(F64x4 a, F64x4 b) { return { _mm256_add_pd(a.v, b.v) }; }
+    friend F64x4 operator-(F64x4 a, F64x4 b) { return { _mm256_sub_pd(a.v, b.v) }; }
+    friend F64x4 operator*(F64x4 a, F64x4 b) { return { _mm256_mul_pd(a.v, b.v) }; }
+    friend F64x4 operator/(F64x4 a, F64x4 b) { return { _mm256_div_pd(a.v, b.v) }; }
+
+    friend Mask operator<(F64x4 a, F64x4 b)  { return { _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ) }; }
+    friend Mask operator<=(F64x4 a, F64x4 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ) }; }
+    friend Mask operator>(F64x4 a, F64x4 b)  { return { _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ) }; }
+    friend Mask operator>=(F64x4 a, F64x4 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ) }; }
+};
+inline F64x4 sqrt(F64x4 a) { return { _mm256_sqrt_pd(a.v) }; }
+inline F64x4 abs(F64x4 a)  { return { _mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v) }; }
+inline F64x4 select(Mask m, F64x4 a, F64x4 b) { return { _mm256_blendv_pd(b.v, a.v, m.v) }; }
+inline F64x4 min(F64x4 a, F64x4 b) { return { _mm256_min_pd(a.v, b.v) }; }
+inline F64x4 max(F64x4 a, F64x4 b) { return { _mm256_max_pd(a.v, b.v) }; }
+inline u32 bits(Mask m) { return static_cast<u32>(_mm256_movemask_pd(m.v)); }
+
+#elif defined(__SSE2__)
+
+struct Mask {
+    __m128d lo, hi;
+    friend Mask operator&(Mask a, Mask b) { return { _mm_and_pd(a.lo, b.lo), _mm_and_pd(a.hi, b.hi) }; }
+};
+struct F64x4 {
+    __m128d lo, hi;
+
+    static F64x4 splat(Float x)       { return { _mm_set1_pd(x), _mm_set1_pd(x) }; }
+    static F64x4 load(const Float* p) { return { _mm_load_pd(p), _mm_load_pd(p + 2) }; }
+    void store(Float* p) const        { _mm_store_pd(p, lo); _mm_store_pd(p + 2, hi); }
+
+    friend F64x4 operator+(F64x4 a, F64x4 b) { return { _mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi) }; }
+    friend F64x4 operator-(F64x4 a, F64x4 b) { return { _mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi) }; }
+    friend F64x4 operator*(F64x4 a, F64x4 b) { return { _mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi) }; }
+    friend F64x4 operator/(F64x4 a, F64x4 b) { return { _mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi) }; }
+
+    friend Mask operator<(F64x4 a, F64x4 b)  { return { _mm_cmplt_pd(a.lo, b.lo), _mm_cmplt_pd(a.hi, b.hi) }; }
+    friend Mask operator<=(F64x4 a, F64x4 b) { return { _mm_cmple_pd(a.lo, b.lo), _mm_cmple_pd(a.hi, b.hi) }; }
+    friend Mask operator>(F64x4 a, F64x4 b)  { return { _mm_cmpgt_pd(a.lo, b.lo), _mm_cmpgt_pd(a.hi, b.hi) }; }
+    friend Mask operator>=(F64x4 a, F64x4 b) { return { _mm_cmpge_pd(a.lo, b.lo), _mm_cmpge_pd(a.hi, b.hi) }; }
+};
+inline F64x4 sqrt(F64x4 a) { return { _mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi) }; }
+inline F64x4 abs(F64x4 a) {
+    __m128d sign = _mm_set1_pd(-0.0);
+    return { _mm_andnot_pd(sign, a.lo), _mm_andnot_pd(sign, a.hi) };
+}
+inline F64x4 select(Mask m, F64x4 a, F64x4 b) {
+    return {
+        _mm_or_pd(_mm_and_pd(m.lo, a.lo), _mm_andnot_pd(m.lo, b.lo)),
+        _mm_or_pd(_mm_and_pd(m.hi, a.hi), _mm_andnot_pd(m.hi, b.hi))
+    };
+}
+inline F64x4 min(F64x4 a, F64x4 b) { return { _mm_min_pd(a.lo, b.lo), _mm_min_pd(a.hi, b.hi) }; }
+inline F64x4 max(F64x4 a, F64x4 b) { return { _mm_max_pd(a.lo, b.lo), _mm_max_pd(a.hi, b.hi) }; }
+inline u32 bits(Mask m) {
+    return static_cast<u32>(_mm_movemask_pd(m.lo) | (_mm_movemask_pd(m.hi) << 2));
+}
+
+#else
+
+// Portable fallback, plain loops the compiler is free to vectorize
+struct Mask {
+    bool v[WIDTH];
+    friend Mask operator&(Mask a, Mask b) {
+        Mask out;
+        for(size_t i = 0; i < WIDTH; i++) out.v[i] = a.v[i] && b.v[i];
+        return out;
+    }
+};
+struct F64x4 {
+    Float v[WIDTH];
+
+    static F64x4 splat(Float x) {
+        F64x4 out;
+        for(size_t i = 0; i < WIDTH; i++) out.v[i] = x;
+        return out;
+    }
+    static F64x4 load(const Float* p) {
+        F64x4 out;
+        for(size_t i = 0; i < WIDTH; i++) out.v[i] = p[i];
+        return out;
+    }
+    void store(Float* p) const {
+        for(size_t i = 0; i < WIDTH; i++) p[i] = v[i];
+    }
+
+    template<typename Fn>
+    static F64x4 map(F64x4 a, F64x4 b, Fn fn) {
+        F64x4 out;
+        for(size_t i = 0; i < WIDTH; i++) out.v[i] = fn(a.v[i], b.v[i]);
+        return out;
+    }
+    template<typename Fn>
+    static Mask compare(F64x4 a, F64x4 b, Fn fn) {
+        Mask out;
+        for(size_t i = 0; i < WIDTH; i++) out.v[i] = fn(a.v[i], b.v[i]);
+        return out;
+    }
+
+    friend F64x4 operator+(F64x4 a, F64x4 b) { return map(a, b, [](Float x, Float y) { return x + y; }); }
+    friend F64x4 operator-(F64x4 a, F64x4 b) { return map(a, b, [](Float x, Float y) { return x - y; }); }
+    friend F64x4 operator*(F64x4 a, F64x4 b) { return map(a, b, [](Float x, Float y) { return x * y; }); }
+    friend F64x4 operator/(F64x4 a, F64x4 b) { return map(a, b, [](Float x, Float y) { return x / y; }); }
+
+    friend Mask operator<(F64x4 a, F64x4 b)  { return compare(a, b, [](Float x, Float y) { return x < y; }); }
+    friend Mask operator<=(F64x4 a, F64x4 b) { return compare(a, b, [](Float x, Float y) { return x <= y; }); }
+    friend Mask operator>(F64x4 a, F64x4 b)  { return compare(a, b, [](Float x, Float y) { return x > y; }); }
+    friend Mask operator>=(F64x4 a, F64x4 b) { return compare(a, b, [](Float x, Float y) { return x >= y; }); }
+};
+inline F64x4 sqrt(F64x4 a) {
+    F64x4 out;
+    for(size_t i = 0; i < WIDTH; i++) out.v[i] = std::sqrt(a.v[i]);
+    return out;
+}
+inline F64x4 abs(F64x4 a) {
+    F64x4 out;
+    for(size_t i = 0; i < WIDTH; i++) out.v[i] = std::abs(a.v[i]);
+    return out;
+}
+inline F64x4 select(Mask m, F64x4 a, F64x4 b) {
+    F64x4 out;
+    for(size_t i = 0; i < WIDTH; i++) out.v[i] = m.v[i] ? a.v[i] : b.v[i];
+    return out;
+}
+inline F64x4 min(F64x4 a, F64x4 b) {
+    return F64x4::map(a, b, [](Float x, Float y) { return x < y ? x : y; });
+}
+inline F64x4 max(F64x4 a, F64x4 b) {
+    return F64x4::map(a, b, [](Float x, Float y) { return x > y ? x : y; });
+}
+inline u32 bits(Mask m) {
+    u32 out = 0;
+    for(size_t i = 0; i < WIDTH; i++) out |= static_cast<u32>(m.v[i]) << i;
+    return out;
+}
+
+#endif
+
+// min and max return `b` when either operand is NaN, on every backend
+// bits packs lane i of a mask into bit i
+
+inline const char* backend() {
+#if defined(__AVX__)
+    return "avx";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+
+struct alignas(32) SphereBlock {
+    Float px[WIDTH], py[WIDTH], pz[WIDTH];
+    Float radius2[WIDTH];
+    u32 prim[WIDTH];
+};
+
+/// Planes are discs with infinite radius
+struct alignas(32) DiscBlock {
+    Float px[WIDTH], py[WIDTH], pz[WIDTH];
+    Float nx[WIDTH], ny[WIDTH], nz[WIDTH];
+    Float radius2[WIDTH];
+    u32 prim[WIDTH];
+};
+
+struct alignas(32) DiamondBlock {
+    Float px[WIDTH], py[WIDTH], pz[WIDTH];
+    Float nx[WIDTH], ny[WIDTH], nz[WIDTH];
+    Float ax[WIDTH], ay[WIDTH], az[WIDTH];
+    Float bx[WIDTH], by[WIDTH], bz[WIDTH];
+    Float a_norm[WIDTH];
+    Float b_norm[WIDTH];
+    u32 prim[WIDTH];
+};
+
+/// Fills every lane with NaN, lanes are then set with `set`
+template<typename Block>
+Block empty_block() {
+    Block block;
+    Float* data = reinterpret_cast<Float*>(&block);
+    for(size_t i = 0; i < offsetof(Block, prim) / sizeof(Float); i++) {
+        data[i] = std::numeric_limits<Float>::quiet_NaN();
+    }
+    for(size_t i = 0; i < WIDTH; i++) {
+        block.prim[i] = 0;
+    }
+    return block;
+}
+
+/// Nearest lane with distance below tmax, `prim` is the lane's primitive
+struct BlockHit {
+    Float dist = INFINITY;
+    u32 prim = 0;
+    bool hit = false;
+};
+
+struct RayLanes {
+    F64x4 ox, oy, oz;
+    F64x4 dx, dy, dz;
+
+    RayLanes(const Ray& ray)
+    : ox(F64x4::splat(ray.pos.x)), oy(F64x4::splat(ray.pos.y)), oz(F64x4::splat(ray.pos.z))
+    , dx(F64x4::splat(ray.dir.x)), dy(F64x4::splat(ray.dir.y)), dz(F64x4::splat(ray.dir.z))
+    {}
+};
+
+template<typename Block>
+inline void nearest_lane(const Block& block, F64x4 t, BlockHit& out) {
+    alignas(32) Float dist[WIDTH];
+    t.store(dist);
+    for(size_t i = 0; i < WIDTH; i++) {
+        if(dist[i] < out.dist) {
+            out = { dist[i], block.prim[i], true };
+        }
+    }
+}
+
+/// Same test as Sphere::intersect, updating `out` if a lane is nearer
+inline void intersect(const SphereBlock& block, const RayLanes& ray, BlockHit& out) {
+    F64x4 zero = F64x4::splat(0.0);
+
+    F64x4 xx = ray.ox - F64x4::load(block.px);
+    F64x4 xy = ray.oy - F64x4::load(block.py);
+    F64x4 xz = ray.oz - F64x4::load(block.pz);
+
+    F64x4 p = xx * ray.dx + xy * ray.dy + xz * ray.dz;
+    F64x4 q = xx * xx + xy * xy + xz * xz - F64x4::load(block.radius2);
+    F64x4 D = p * p - q;
+
+    F64x4 root = sqrt(select(D >= zero, D, zero));
+    F64x4 t = select(q >= zero, zero - p - root, zero - p + root);
+
+    Mask hit = (D >= zero) & (t > zero) & (t < F64x4::splat(out.dist));
+    nearest_lane(block, select(hit, t, F64x4::splat(INFINITY)), out);
+}
+
+/// Same test as Disc::intersect, updating `out` if a lane is nearer
+inline void intersect(const DiscBlock& block, const RayLanes& ray, BlockHit& out) {
+    F64x4 zero = F64x4::splat(0.0);
+
+    F64x4 nx = F64x4::load(block.nx);
+    F64x4 ny = F64x4::load(block.ny);
+    F64x4 nz = F64x4::load(block.nz);
+
+    F64x4 rx = F64x4::load(block.px) - ray.ox;
+    F64x4 ry = F64x4::load(block.py) - ray.oy;
+    F64x4 rz = F64x4::load(block.pz) - ray.oz;
+
+    F64x4 ray_n = nx * ray.dx + ny * ray.dy + nz * ray.dz;
+    F64x4 t = (nx * rx + ny * ry + nz * rz) / ray_n;
+
+    // Hit relative to disc center
+    F64x4 hx = t * ray.dx - rx;
+    F64x4 hy = t * ray.dy - ry;
+    F64x4 hz = t * ray.dz - rz;
+
+    Mask hit = (t > zero) & (t < F64x4::splat(out.dist))
+             & (hx * hx + hy * hy + hz * hz <= F64x4::load(block.radius2));
+    nearest_lane(block, select(hit, t, F64x4::splat(INFINITY)), out);
+}
+
+/// Same test as Diamond::intersect, updating `out` if a lane is nearer
+inline void intersect(const DiamondBlock& block, const RayLanes& ray, BlockHit& out) {
+    F64x4 zero = F64x4::splat(0.0);
+
+    F64x4 nx = F64x4::load(block.nx);
+    F64x4 ny = F64x4::load(block.ny);
+    F64x4 nz = F64x4::load(block.nz);
+
+    F64x4 rx = F64x4::load(block.px) - ray.ox;
+    F64x4 ry = F64x4::load(block.py) - ray.oy;
+    F64x4 rz = F64x4::load(block.pz) - ray.oz;
+
+    F64x4 ray_n = nx * ray.dx + ny * ray.dy + nz * ray.dz;
+    F64x4 t = (nx * rx + ny * ry + nz * rz) / ray_n;
+
+    F64x4 hx = t * ray.dx - rx;
+    F64x4 hy = t * ray.dy - ry;
+    F64x4 hz = t * ray.dz - rz;
+
+    F64x4 a_comp = abs(F64x4::load(block.ax) * hx + F64x4::load(block.ay) * hy + F64x4::load(block.az) * hz);
+    F64x4 b_comp = abs(F64x4::load(block.bx) * hx + F64x4::load(block.by) * hy + F64x4::load(block.bz) * hz);
+
+    Mask hit = (t > zero) & (t < F64x4::splat(out.dist))
+             & (a_comp <= F64x4::load(block.a_norm))
+             & (b_comp <= F64x4::load(block.b_norm));
+    nearest_lane(block, select(hit, t, F64x4::splat(INFINITY)), out);
+}
+
+/// Flat list or BVH leaf of blocks
+template<typename Block>
+inline void intersect(const Block* blocks, size_t count, const RayLanes& ray, BlockHit& out) {
+    telemetry::count(telemetry::PrimitiveTests, count * WIDTH);
+    for(size_t i = 0; i < count; i++) {
+        intersect(blocks[i], ray, out);
+    }
+}
+
+}
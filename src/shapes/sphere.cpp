@@ -18,7 +18,8 @@ void Sphere::format(std::ostream& out, size_t indent) const {
     out << "Sphere(pos: " << m_pos << ", rad: " << m_radius << ")";
 }
 
-Intersection Sphere::intersect(Ray ray) const { 
+Hit Sphere::hit(const Ray& ray, Float tmax) const { 
+    telemetry::count(telemetry::PrimitiveTests);
     // Move sphere to origin
     Vec3f x = ray.pos - m_pos;
 
@@ -30,38 +31,46 @@ Intersection Sphere::intersect(Ray ray) const {
     Float q = x.norm_squared() - m_radius * m_radius;
     Float D = p * p - q;
 
-    if (q >= 0.0) {
-        // Outside sphere
-        // both solutions have same sign
-        Float t = -p - std::sqrt(D);
+    // Outside sphere: both solutions have same sign
+    // Inside sphere: far solution guaranteed to be positive
+    Float t = (q >= 0.0) ? -p - std::sqrt(D) : -p + std::sqrt(D);
 
-        if (t <= 0.0) return { .hit = false };
+    // Also rejects the NaN of a miss (D < 0)
+    if(!(t > 0.0 && t < tmax)) return {};
 
-        Vec3f y = x + t * ray.dir;
-        return {
-            .local = {
-                .pos    = y + m_pos,
-                .normal = y.unit(),
-                .material = &m_material 
-            },
-            .dist   = t,
-            .hit    = true,
-        };
-    }
-    else {
-        // Inside sphere
-        // solution guaranteed to be positive
-        Float t = -p + std::sqrt(D);
-        Vec3f y = x + t * ray.dir;   
+    return { .dist = t, .shape = this };
+};
 
-        return {
-            .local = {
-                .pos    = y + m_pos,
-                .normal = -y.unit(),
-                .material = &m_material
-            },
-            .dist   = t,
-            .hit    = true, 
-        };
-    }
-};
\ No newline at end of file
+LocalSurface Sphere::surface_at(const Ray& ray, const Hit& hit) const {
+    Vec3f x = ray.pos - m_pos;
+    Vec3f y = x + hit.dist * ray.dir;
+
+    // Rays starting inside see the inner side
+    bool outside = x.norm_squared() >= m_radius * m_radius;
+    return {
+        .pos      = y + m_pos,
+        .normal   = outside ? y.unit() : -y.unit(),
+        .material = &m_material
+    };
+}
+
+SurfaceSample Sphere::sample_point(Vec2f u) const {
+    Vec3f normal = sample_sphere(u);
+    return {
+        .local = {
+            .pos      = m_pos + m_radius * normal,
+            .normal   = normal,
+            .material = &m_material
+        },
+        .pdf = pdf(m_pos)
+    };
+}
+
+Float Sphere::pdf(Vec3f pos) const {
+    return 1.0 / (4.0 * M_PI * m_radius * m_radius);
+}
+
+Bounds3f Sphere::bounds() const {
+    Vec3f extent = Vec3f::splat(m_radius);
+    return { m_pos - extent, m_pos + extent };
+}
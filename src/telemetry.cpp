@@ -0,0 +1,49 @@
+#include "telemetry.hpp"
+
+namespace telemetry {
+
+static std::atomic<Counters*> s_threads = nullptr;
+
+Counters* add_thread() {
+    auto* counters = new Counters();
+    Counters* head = s_threads.load(std::memory_order_relaxed);
+    do {
+        counters->next = head;
+    } while(!s_threads.compare_exchange_weak(head, counters, std::memory_order_release, std::memory_order_relaxed));
+    return counters;
+}
+
+Snapshot totals() {
+    Snapshot out;
+    auto load = [](u64& value) {
+        return std::atomic_ref<u64>(value).load(std::memory_order_relaxed);
+    };
+    for(Counters* counters = s_threads.load(std::memory_order_acquire); counters; counters = counters->next) {
+        for(size_t i = 0; i < COUNTERS; i++) {
+            out.values[i] += load(counters->values[i]);
+        }
+        for(size_t i = 0; i < PATH_BINS; i++) {
+            out.path_lengths[i] += load(counters->path_lengths[i]);
+        }
+        out.threads++;
+    }
+    return out;
+}
+
+void write_json(std::ostream& out, const Snapshot& now, const Snapshot& previous, Float seconds) {
+    const char* names[COUNTERS] = { "rays", "primitive_tests", "hits", "misses", "splats" };
+
+    out << "{ \"threads\": " << now.threads;
+    for(size_t i = 0; i < COUNTERS; i++) {
+        Float rate = (seconds > 0.0) ? (now.values[i] - previous.values[i]) / seconds : 0.0;
+        out << ", \"" << names[i] << "\": " << now.values[i]
+            << ", \"" << names[i] << "_per_s\": " << rate;
+    }
+    out << ", \"path_lengths\": [";
+    for(size_t i = 0; i < PATH_BINS; i++) {
+        out << (i > 0 ? ", " : "") << now.path_lengths[i];
+    }
+    out << "] }" << std::endl;
+}
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "prelude.hpp"
+
+#include <atomic>
+
+/// Hot path counters, one set per thread alone on its cache lines, summed without locks
+/// Counting compiles to nothing unless PATHSPACE_TELEMETRY is defined (meson -Dtelemetry=true)
+namespace telemetry {
+
+#ifdef PATHSPACE_TELEMETRY
+constexpr bool ENABLED = true;
+#else
+constexpr bool ENABLED = false;
+#endif
+
+enum Counter : u32 {
+    /// Closest hit and shadow queries of the integrators, camera rays included
+    Rays,
+    /// Primitive intersection tests, blocks of the SIMD kernels count every lane
+    PrimitiveTests,
+    /// Rays that hit a surface or found their light occluded, and the rest
+    Hits,
+    Misses,
+    /// Samples added to tile buffers and frames
+    Splats,
+    COUNTERS
+};
+/// Path lengths in segments, the last bin takes longer paths as well
+constexpr size_t PATH_BINS = 16;
+
+/// Written by one thread only, so counting is a plain add, read by anyone
+struct alignas(64) Counters {
+    u64 values[COUNTERS] = {};
+    u64 path_lengths[PATH_BINS] = {};
+    /// Every thread's counters stay in a list for the life of the process
+    Counters* next = nullptr;
+};
+
+/// Allocates the counters of the calling thread and links them into the list
+Counters* add_thread();
+
+inline thread_local Counters* t_counters = nullptr;
+
+inline void bump(u64& value, u64 n) {
+    // Relaxed load and store rather than an atomic add, readers only need untorn values
+    std::atomic_ref<u64> ref(value);
+    ref.store(ref.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void count(Counter counter, u64 n = 1) {
+    if constexpr(ENABLED) {
+        if(!t_counters) t_counters = add_thread();
+        bump(t_counters->values[counter], n);
+    }
+}
+inline void path_length(u64 segments, u64 n = 1) {
+    if constexpr(ENABLED) {
+        if(!t_counters) t_counters = add_thread();
+        bump(t_counters->path_lengths[std::min<u64>(segments, PATH_BINS - 1)], n);
+    }
+}
+
+struct Snapshot {
+    u64 values[COUNTERS] = {};
+    u64 path_lengths[PATH_BINS] = {};
+    size_t threads = 0;
+};
+/// Sums over every thread so far, safe while they count
+Snapshot totals();
+/// One line JSON object of `now`, with rates since `previous`, `seconds` before
+void write_json(std::ostream& out, const Snapshot& now, const Snapshot& previous, Float seconds);
+
+}